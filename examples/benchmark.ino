@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include <inttypes.h>
+#include "spiffs_circular_queue.h"
+
+// Throughput and latency of the queue operations, printed as CSV:
+//   mode,elem_size,fill_pct,op,count,total_us,avg_us,max_us,ops_per_s
+// Each combination of mode, elem size and fill level runs enqueue/front/dequeue rounds
+//   at a steady fill level, then drains the queue. The queue size is not a multiple of
+//   the elem footprint, so elems keep splitting over the file end as the rounds wrap.
+
+#define BENCH_QUEUE_ELEMS       16      // queue capacity in elems
+#define BENCH_ROUNDS            (4*BENCH_QUEUE_ELEMS) // wraps the queue four times
+#define BENCH_MAX_ELEM_SIZE     4096
+
+typedef struct {
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+} bench_stat_t;
+
+static const uint16_t elem_sizes[] = {4, 16, 64, 256, 1024, BENCH_MAX_ELEM_SIZE};
+static const uint8_t fill_levels[] = {0, 50, 90};
+static uint8_t buf[BENCH_MAX_ELEM_SIZE];
+
+circular_queue_t cq;
+
+void bench_add(bench_stat_t *stat, uint32_t start) {
+    uint32_t us = micros() - start;
+
+    stat->count++;
+    stat->total_us += us;
+    if (us > stat->max_us) stat->max_us = us;
+}
+
+void bench_print(const char *mode, uint16_t elem_size, uint8_t fill, const char *op, const bench_stat_t *stat) {
+    uint32_t avg_us = stat->count? stat->total_us/stat->count : 0;
+    uint32_t ops_per_s = stat->total_us? (uint32_t)(1000000ull*stat->count/stat->total_us) : 0;
+
+    printf("%s,%u,%u,%s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", mode, elem_size, fill, op,
+        stat->count, stat->total_us, avg_us, stat->max_us, ops_per_s);
+}
+
+void bench_run(uint8_t fixed, uint16_t elem_size, uint8_t fill) {
+    bench_stat_t enqueue = {}, front = {}, dequeue = {}, drain = {};
+    uint16_t footprint = elem_size + (fixed? 0 : sizeof(uint16_t));
+    uint16_t size = 0;
+    uint32_t start = 0;
+
+    memset(&cq, 0, sizeof(cq));
+    snprintf(cq.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/bench");
+    cq.elem_size = fixed? elem_size : 0;
+    cq.max_size = BENCH_QUEUE_ELEMS*footprint + footprint/2;
+
+    if (spiffs_circular_queue_init(&cq)) {
+        // fill level, leaving room for the round's enqueue
+        uint16_t prefill = BENCH_QUEUE_ELEMS*fill/100;
+        if (prefill >= BENCH_QUEUE_ELEMS) prefill = BENCH_QUEUE_ELEMS - 1;
+        for (uint16_t i = 0; i < prefill; i++) spiffs_circular_queue_enqueue(&cq, buf, elem_size);
+
+        for (uint16_t i = 0; i < BENCH_ROUNDS; i++) {
+            start = micros();
+            if (spiffs_circular_queue_enqueue(&cq, buf, elem_size)) bench_add(&enqueue, start);
+            start = micros();
+            if (spiffs_circular_queue_front(&cq, buf, &size)) bench_add(&front, start);
+            start = micros();
+            if (spiffs_circular_queue_dequeue(&cq, buf, &size)) bench_add(&dequeue, start);
+        }
+
+        start = micros();
+        spiffs_circular_queue_foreach_dequeue(&cq, buf, &size) {
+            bench_add(&drain, start);
+            start = micros();
+        }
+
+        const char *mode = fixed? "fixed" : "variable";
+        bench_print(mode, elem_size, fill, "enqueue", &enqueue);
+        bench_print(mode, elem_size, fill, "front", &front);
+        bench_print(mode, elem_size, fill, "dequeue", &dequeue);
+        bench_print(mode, elem_size, fill, "drain", &drain);
+
+        spiffs_circular_queue_free(&cq, 0);
+    } else {
+        printf("# %s elem size %u: init failed\n", fixed? "fixed" : "variable", elem_size);
+    }
+}
+
+void setup() {
+    for (uint16_t i = 0; i < sizeof(buf); i++) buf[i] = i;
+
+    printf("mode,elem_size,fill_pct,op,count,total_us,avg_us,max_us,ops_per_s\n");
+    for (uint8_t fixed = 0; fixed <= 1; fixed++) {
+        for (uint8_t s = 0; s < sizeof(elem_sizes)/sizeof(elem_sizes[0]); s++) {
+            for (uint8_t f = 0; f < sizeof(fill_levels); f++) {
+                bench_run(fixed, elem_sizes[s], fill_levels[f]);
+            }
+        }
+    }
+    printf("# done\n");
+}
+
+void loop() {
+    delay(1000);
+}
@@ -0,0 +1,122 @@
+#include <Arduino.h>
+#include <inttypes.h>
+#include "esp_sleep.h"
+#include "esp_spiffs.h"
+#include "spiffs_circular_queue.h"
+
+#if !SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE || !SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+#error "needs SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE and SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN"
+#endif
+
+// Cold start cost of the queues, printed as CSV:
+//   queues,fill_pct,files,used_kb,total_kb,queue,mount_us,stat_us,open_us,header_us,scan_us,init_us,first_front_us
+// Every configuration takes two boots: the first one formats SPIFFS, writes filler files and fills
+//   the queues, the second one wakes up from deep sleep and initializes the queues as an application
+//   would. Needs SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE and SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN enabled.
+
+#define BENCH_MAX_QUEUES        8
+#define BENCH_QUEUE_SIZE        4096
+#define BENCH_ELEM_SIZE         32
+#define BENCH_FILLER_SIZE       2048
+#define BENCH_SLEEP_US          100000
+
+typedef struct {
+    uint8_t queues;
+    uint8_t fill_pct;
+    uint8_t files;
+} bench_config_t;
+
+static const bench_config_t configs[] = {
+    {1, 0, 0}, {1, 100, 0}, {1, 100, 32},
+    {4, 0, 0}, {4, 100, 0}, {4, 100, 32},
+    {8, 50, 0}, {8, 100, 64},
+};
+
+RTC_DATA_ATTR static uint16_t step = 0; // survives deep sleep, two steps per configuration
+
+circular_queue_t queues[BENCH_MAX_QUEUES];
+
+void bench_prepare(const bench_config_t *cfg) {
+    uint8_t elem[BENCH_ELEM_SIZE] = {0};
+    uint8_t filler[256] = {0};
+
+    // start from an empty partition, the first queue init mounts it
+    esp_spiffs_format(NULL);
+    for (uint8_t q = 0; q < cfg->queues; q++) {
+        snprintf(queues[q].fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/boot%u", q);
+        queues[q].max_size = BENCH_QUEUE_SIZE;
+        if (spiffs_circular_queue_init(&queues[q])) {
+            uint16_t count = BENCH_QUEUE_SIZE/(BENCH_ELEM_SIZE + sizeof(uint16_t))*cfg->fill_pct/100;
+            for (uint16_t n = 0; n < count && spiffs_circular_queue_enqueue(&queues[q], elem, sizeof(elem)); n++);
+        }
+    }
+
+    for (uint8_t f = 0; f < cfg->files; f++) {
+        char fn[SPIFFS_FILE_NAME_MAX_SIZE];
+        snprintf(fn, sizeof(fn), "/spiffs/filler%u", f);
+        FILE *fd = fopen(fn, "wb");
+        for (uint16_t n = 0; fd && n < BENCH_FILLER_SIZE; n += sizeof(filler)) fwrite(filler, 1, sizeof(filler), fd);
+        if (fd) fclose(fd);
+    }
+}
+
+void bench_measure(const bench_config_t *cfg) {
+    uint8_t elem[BENCH_ELEM_SIZE] = {0};
+    uint16_t elem_size = 0;
+    size_t total = 0, used = 0;
+
+    for (uint8_t q = 0; q < cfg->queues; q++) {
+        snprintf(queues[q].fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/boot%u", q);
+
+        uint32_t start = micros();
+        uint8_t ret = spiffs_circular_queue_init(&queues[q]);
+        uint32_t init_us = micros() - start;
+
+        start = micros();
+        spiffs_circular_queue_front(&queues[q], elem, &elem_size);
+        uint32_t front_us = micros() - start;
+
+        if (!q) esp_spiffs_info(NULL, &total, &used);
+        if (ret) {
+            const circular_queue_init_profile_t *p = &queues[q].init_profile;
+            printf("%u,%u,%u,%u,%u,%u,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", 
+                cfg->queues, cfg->fill_pct, cfg->files,
+                (unsigned)(used/1024), (unsigned)(total/1024), q, p->mount_us, p->stat_us, p->open_us, p->header_us,
+                spiffs_circular_queue_get_recovery_time(&queues[q]), init_us, front_us);
+        } else {
+            printf("# queue %u: init failed\n", q);
+        }
+    }
+}
+
+void setup() {
+    uint16_t configs_count = sizeof(configs)/sizeof(configs[0]);
+
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) step = 0; // power-on, start over
+
+    if (step < 2*configs_count) {
+        const bench_config_t *cfg = &configs[step/2];
+
+        if (!step) {
+            printf("queues,fill_pct,files,used_kb,total_kb,queue,mount_us,stat_us,open_us,header_us,scan_us,init_us,first_front_us\n");
+        }
+        if (step % 2) {
+            bench_measure(cfg);
+        } else {
+            bench_prepare(cfg);
+        }
+        step++;
+
+        fflush(stdout);
+        esp_sleep_enable_timer_wakeup(BENCH_SLEEP_US);
+        esp_deep_sleep_start();
+    }
+
+    // remove the files of the last configuration
+    esp_spiffs_format(NULL);
+    printf("# done\n");
+}
+
+void loop() {
+    delay(1000);
+}
@@ -0,0 +1,75 @@
+#include <Arduino.h>
+#include <inttypes.h>
+#include "spiffs_circular_queue.h"
+
+#if !SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+#error "needs SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN"
+#endif
+
+// Recovery scan time against the queue size, printed as CSV:
+//   max_size,elem_size,fill_pct,count,runs,scan_avg_us,scan_max_us,init_avg_us,scan_us_per_kb
+// Each queue is filled once and then re-initialized several times, as an application would be
+//   on wake-up. The scan walks every stored elem, so its time follows the queue bytes held rather
+//   than the queue size. Needs SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN enabled.
+
+#define BENCH_RUNS              8
+#define BENCH_MAX_ELEM_SIZE     256
+
+static const uint32_t queue_sizes[] = {1024, 4096, 16384, 65536};
+static const uint16_t elem_sizes[] = {16, BENCH_MAX_ELEM_SIZE};
+static const uint8_t fill_levels[] = {50, 100};
+static uint8_t buf[BENCH_MAX_ELEM_SIZE];
+
+circular_queue_t cq;
+
+void bench_run(uint32_t max_size, uint16_t elem_size, uint8_t fill) {
+    uint32_t scan_total = 0, scan_max = 0, init_total = 0;
+    uint8_t runs = 0;
+
+    memset(&cq, 0, sizeof(cq));
+    snprintf(cq.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/rbench");
+    cq.max_size = max_size;
+
+    if (spiffs_circular_queue_init(&cq)) {
+        uint32_t target = (uint64_t)max_size*fill/100;
+        while (max_size - spiffs_circular_queue_available_space(&cq) + elem_size <= target &&
+               spiffs_circular_queue_enqueue(&cq, buf, elem_size));
+
+        for (; runs < BENCH_RUNS; runs++) {
+            uint32_t start = micros();
+            if (!spiffs_circular_queue_init(&cq)) break;
+            init_total += micros() - start;
+
+            uint32_t scan_us = spiffs_circular_queue_get_recovery_time(&cq);
+            scan_total += scan_us;
+            if (scan_us > scan_max) scan_max = scan_us;
+        }
+
+        uint32_t kb = (max_size - spiffs_circular_queue_available_space(&cq))/1024;
+        printf("%" PRIu32 ",%u,%u,%u,%u,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", 
+            max_size, elem_size, fill, spiffs_circular_queue_get_count(&cq), runs,
+            runs? scan_total/runs : 0, scan_max, runs? init_total/runs : 0, runs && kb? scan_total/runs/kb : 0);
+
+        spiffs_circular_queue_free(&cq, 0);
+    } else {
+        printf("# max_size %" PRIu32 ": init failed\n", max_size);
+    }
+}
+
+void setup() {
+    for (uint16_t i = 0; i < sizeof(buf); i++) buf[i] = i;
+
+    printf("max_size,elem_size,fill_pct,count,runs,scan_avg_us,scan_max_us,init_avg_us,scan_us_per_kb\n");
+    for (uint8_t q = 0; q < sizeof(queue_sizes)/sizeof(queue_sizes[0]); q++) {
+        for (uint8_t s = 0; s < sizeof(elem_sizes)/sizeof(elem_sizes[0]); s++) {
+            for (uint8_t f = 0; f < sizeof(fill_levels); f++) {
+                bench_run(queue_sizes[q], elem_sizes[s], fill_levels[f]);
+            }
+        }
+    }
+    printf("# done\n");
+}
+
+void loop() {
+    delay(1000);
+}
@@ -13,30 +13,443 @@
 #error Library designed to work with ESP32 arch and x-tensa toolchain 
 #endif
 
+#include <unistd.h>
+#include <atomic>
+#include <new>
+
+#include "freertos/task.h"
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+#include "freertos/queue.h"
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+#include "esp_heap_caps.h"
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+#include "esp_rom_crc.h"
+#endif
+
 #define CIRCULAR_QUEUE_DATA_OFFSET_FIXED    (sizeof(uint32_t)*3 + \
                                             sizeof(uint16_t)    + \
                                             sizeof(uint8_t))    ///< Data location file offset (fixed part)
 
+#define CIRCULAR_QUEUE_REGISTRY             (SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST || \
+                                            SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER) ///< Initialized queues tracked, for sync_all and the space manager
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#define CIRCULAR_QUEUE_LOCK(mutex)          xSemaphoreTake((mutex), portMAX_DELAY)  ///< Blocks until mutex is taken
+#define CIRCULAR_QUEUE_UNLOCK(mutex)        xSemaphoreGive((mutex))                 ///< Releases a taken mutex
+#define CIRCULAR_QUEUE_LOCK_RECURSIVE(mutex)    xSemaphoreTakeRecursive((mutex), portMAX_DELAY) ///< Blocks until mutex is taken, nests
+#define CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mutex)  xSemaphoreGiveRecursive((mutex))                ///< Releases one nesting level
+#else
+#define CIRCULAR_QUEUE_LOCK(mutex)
+#define CIRCULAR_QUEUE_UNLOCK(mutex)
+#define CIRCULAR_QUEUE_LOCK_RECURSIVE(mutex)
+#define CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mutex)
+#endif
+
+#define CIRCULAR_QUEUE_CURSOR_ENTRY_SIZE    (SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE + \
+                                            sizeof(uint32_t) + sizeof(uint16_t))    ///< Cursor header entry: name, front, ahead
+#define CIRCULAR_QUEUE_CURSORS_TABLE_SIZE   (SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS*CIRCULAR_QUEUE_CURSOR_ENTRY_SIZE) ///< Cursors header part
+
+#define CIRCULAR_QUEUE_HEADER_MAX_SIZE      (CIRCULAR_QUEUE_DATA_OFFSET_FIXED + sizeof(uint16_t) + \
+                                            CIRCULAR_QUEUE_CURSORS_TABLE_SIZE)  ///< Largest queue header
+
+static_assert(CIRCULAR_QUEUE_HEADER_MAX_SIZE <= UINT8_MAX,
+    "Cursors table doesn't fit the queue header, reduce SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS or SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE");
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+#define CIRCULAR_QUEUE_EVENT_DATA           (1u << 0)   ///< An elem was enqueued
+#define CIRCULAR_QUEUE_EVENT_SPACE          (1u << 1)   ///< Queue space was freed
+#define CIRCULAR_QUEUE_SIGNAL(cq, event)    do { if ((cq)->events) xEventGroupSetBits((cq)->events, (event)); } while (0) ///< Wakes up the waiting calls
+#else
+#define CIRCULAR_QUEUE_SIGNAL(cq, event)
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE
+#define CIRCULAR_QUEUE_INIT_PHASE(cq, phase, start) \
+    do { (cq)->init_profile.phase = micros() - (start); (start) = micros(); } while (0) ///< Ends an init phase timing
+#else
+#define CIRCULAR_QUEUE_INIT_PHASE(cq, phase, start)
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+#define CIRCULAR_QUEUE_FWRITE(data, size, count, fd)    _fault_fwrite((data), (size), (count), (fd)) ///< Medium write, counted when armed
+#else
+#define CIRCULAR_QUEUE_FWRITE(data, size, count, fd)    fwrite((data), (size), (count), (fd))        ///< Medium write
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+#define CIRCULAR_QUEUE_MULTI_HDR_FIXED      (sizeof(uint8_t)*2 + \
+                                            sizeof(uint16_t)*4)  ///< Container header fixed part: flags, queues count, 
+                                                                 ///  block size, blocks count, free block and count
+#define CIRCULAR_QUEUE_MULTI_LANE_SIZE      (sizeof(uint16_t)*5) ///< Queue record in the container header: head and 
+                                                                 ///  tail blocks and offsets, count
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+/// Simulated power cut state
+typedef struct {
+    uint8_t armed;                  ///< Writes are counted towards the cut
+    uint8_t cut;                    ///< Power is gone, writes and syncs fail
+    uint32_t writes;                ///< Medium writes since armed
+    uint32_t cut_after;             ///< Last write before the cut
+    uint32_t torn_size;             ///< Bytes issued of the last write
+    uint16_t page_size;             ///< Flash page size
+    FILE *page_fd;                  ///< File of the page not programmed yet, NULL if none
+    uint32_t page;                  ///< Page not programmed yet
+    uint16_t page_len;              ///< Bytes of the page programmed content, less than a page at the file end
+    uint8_t *page_image;            ///< Page programmed content, page_size bytes
+} circular_queue_fault_t;
+
+static circular_queue_fault_t _fault = {};          ///< Fault injection state, single task use only
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+/// Queue file handle kept open in the pool
+typedef struct {
+    const void *owner;              ///< Owner queue or container, NULL if the entry is free
+    char fn[SPIFFS_FILE_NAME_MAX_SIZE]; ///< Path the handle was opened on, the owner may be re-pointed to another file
+    FILE *fd;                       ///< Open queue file handle
+    uint8_t in_use;                 ///< Handle is taken by an ongoing operation
+    uint32_t last_used;             ///< Pool clock value at last release, for LRU eviction
+} circular_queue_fd_entry_t;
+#endif
+
+#if CIRCULAR_QUEUE_REGISTRY
+static circular_queue_t *_registry[SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE];        ///< Initialized queues
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+static circular_queue_fd_entry_t _fd_pool[SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE];  ///< Open queue files
+static uint32_t _fd_pool_clock = 0;                                             ///< Pool releases counter
+#endif
+static std::atomic<uint8_t> _registry_state(0);     ///< Registry sync objects state: 0 none, 1 creating, 2 created
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+static SemaphoreHandle_t _registry_mutex = NULL;    ///< Guards the registry and the pool
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+static SemaphoreHandle_t _fd_pool_slots = NULL;     ///< Counts pool entries not in use
+#endif
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+#define CIRCULAR_QUEUE_FRONTEND_HDR_SIZE    (sizeof(uint16_t))  ///< RAM ring record header (elem size) length
+#define CIRCULAR_QUEUE_FRONTEND_PAD         (0xFFFFu)           ///< Record size marking a skipped ring tail before wrap
+#define CIRCULAR_QUEUE_FRONTEND_NO_ROOM     (0xFFFFFFFFu)       ///< Reserve result when the RAM ring is full
+
+/// RAM front-end state. head is written only by the producer, tail only by the consumer (flush)
+typedef struct {
+    uint8_t *buf;                   ///< Ring storage of [elem size][elem data] records
+    uint32_t capacity;              ///< Ring storage size in bytes
+    std::atomic<uint32_t> head;     ///< Next record write position
+    std::atomic<uint32_t> tail;     ///< Next record read position
+    TaskHandle_t flush_task;        ///< Task draining the ring into the queue file
+    SemaphoreHandle_t stopped;      ///< Given by the flush task when it exits
+    std::atomic<uint8_t> running;   ///< Cleared to stop the flush task
+} circular_queue_frontend_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+/// ISR staging slot. seq tells whose turn it is: slot index for producers, index + 1 for the consumer
+typedef struct {
+    std::atomic<uint32_t> seq;                          ///< Slot sequence number
+    uint16_t size;                                      ///< Staged elem size
+    uint8_t data[SPIFFS_CIRCULAR_QUEUE_ISR_SLOT_SIZE];  ///< Staged elem data
+} circular_queue_staging_slot_t;
+
+/// ISR staging state. Bounded multi-producer queue, the only consumer is the flush under the enqueue lock
+typedef struct {
+    std::atomic<uint32_t> enqueue_pos;                  ///< Next slot to claim by producers
+    uint32_t dequeue_pos;                               ///< Next slot to move to the queue file
+    circular_queue_staging_slot_t slots[SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS];
+} circular_queue_staging_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+/// Async operation types
+typedef enum {
+    CIRCULAR_QUEUE_ASYNC_ENQUEUE = 0,
+    CIRCULAR_QUEUE_ASYNC_DEQUEUE,
+} circular_queue_async_type_t;
+
+/// Async operation as passed to the I/O worker task
+typedef struct {
+    circular_queue_async_type_t type;   ///< Operation type
+    circular_queue_t *cq;               ///< Target queue
+    void *elem;                         ///< Caller's elem buffer
+    uint16_t elem_size;                 ///< Elem size, set by the worker on dequeue
+    uint8_t result;                     ///< Operation result, set by the worker
+    circular_queue_async_cb_t cb;       ///< Completion callback
+    void *ctx;                          ///< Completion callback user context
+} circular_queue_async_op_t;
+
+static QueueHandle_t _async_ops = NULL;         ///< Pending async operations, in issue order
+static std::atomic<uint8_t> _async_state(0);    ///< I/O worker state: 0 not started, 1 starting, 2 running
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND || SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+/// Origin of an elem buffered in RAM
+typedef enum {
+    CIRCULAR_QUEUE_BUFFERED_FRONTEND = 0,
+    CIRCULAR_QUEUE_BUFFERED_STAGING,
+} circular_queue_buffered_t;
+#endif
+
 
 /// private function to mount SPIFFS during initialization
 static uint8_t _mount_spiffs(void);
 /// private function to unmount SPIFFS when you don't need it, i.e. before going in a sleep mode
 static uint8_t _unmount_spiffs(void);
-/// private function that adds write medium-independent abstraction
-static uint8_t _write_medium(const circular_queue_t *cq, const void *data, const uint16_t data_size);
-/// private function that adds read medium-independent abstraction. data = NULL to read only the size of last elem
-static uint8_t _read_medium(const circular_queue_t *cq, void *data, uint16_t *data_size);
+/// private function that adds write medium-independent abstraction, writes the elem of data_size gathered from iov at idx
+static uint8_t _write_medium(const circular_queue_t *cq, FILE *fd, const uint32_t idx, const circular_queue_iovec_t *iov, 
+                             const uint8_t iovcnt, const uint16_t data_size);
+/// private function that writes data at the queue index idx, the file position, wrapping over the file end. Advances idx
+static uint16_t _write_ring(const circular_queue_t *cq, FILE *fd, uint32_t *idx, const void *data, const uint16_t size);
+/// private function that adds read medium-independent abstraction, reads the elem at front_idx. data = NULL to read only the size of last elem
+static uint8_t _read_medium(const circular_queue_t *cq, FILE *fd, const uint32_t front_idx, void *data, uint16_t *data_size);
 /// private function that saves current pointers to the queue file
-static uint8_t _spiffs_circular_queue_persist(const circular_queue_t *cq);
+static uint8_t _spiffs_circular_queue_persist(circular_queue_t *cq, FILE *fd);
+/// private function to persist the queue header or to mark it dirty in deferred persist mode
+static uint8_t _persist_or_defer(circular_queue_t *cq, FILE *fd);
+/// private function that makes the single fragment of a contiguous elem, elem_size is don't care for fixed elem size queues
+static inline circular_queue_iovec_t _iov_single(const circular_queue_t *cq, const void *elem, const uint16_t elem_size);
+/// private function to enqueue into the file and to update the header with persist
+static uint8_t _enqueue_file(circular_queue_t *cq, const circular_queue_iovec_t *iov, const uint8_t iovcnt, 
+                             uint8_t (*persist)(circular_queue_t *, FILE *));
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+/// private function to leave the header change to the next persist
+static uint8_t _mark_dirty(circular_queue_t *cq, FILE *fd);
+#endif
+/// private function that writes an elem past back index and advances it without persisting. Enqueue lock must be held
+static uint8_t _enqueue_medium(circular_queue_t *cq, FILE *fd, const circular_queue_iovec_t *iov, const uint8_t iovcnt);
+/// private function that writes an elem past back index and the pending bytes of a batch not committed yet. Returns the
+///   bytes taken, size prefix included, 0 on fail. Enqueue lock must be held
+static uint32_t _enqueue_write(circular_queue_t *cq, FILE *fd, const circular_queue_iovec_t *iov, const uint8_t iovcnt, 
+                               const uint32_t pending);
+/// private function that checks whether an elem of enqueue_size fits past back index and pending bytes. Enqueue lock 
+///   must be held
+static uint8_t _enqueue_admit(circular_queue_t *cq, FILE *fd, const uint32_t pending, const uint32_t enqueue_size);
+/// private function that advances back index over count elems written in size bytes, syncing them first if consumers 
+///   read through their own file handle. Enqueue lock must be held
+static uint8_t _enqueue_commit(circular_queue_t *cq, FILE *fd, const uint32_t size, const uint16_t count);
+/// private function that reads the front elem and advances front index without persisting. Dequeue lock must be held
+static uint8_t _dequeue_medium(circular_queue_t *cq, FILE *fd, void *elem, uint16_t *elem_size);
+/// private function that takes a file handle of the owner on fn from the pool, opening or creating the file if needed.
+///   Opens the file every time if the pool is disabled
+static FILE *_pool_open(const void *owner, const char *fn, const uint8_t create);
+/// private function that takes a queue file handle from the pool
+static inline FILE *_open_medium(const circular_queue_t *cq, const uint8_t create);
+/// private function that syncs and gives a file handle back to the pool, it stays open. Closes it if the pool is disabled
+static void _pool_close(FILE *fd);
+/// private function that gives a queue file handle back to the pool, then reports the watermarks crossed meanwhile
+static void _close_medium(circular_queue_t *cq, FILE *fd);
+/// private function that pushes written data down to the flash
+static uint8_t _sync_medium(FILE *fd);
+#if SPIFFS_CIRCULAR_QUEUE_MULTI || SPIFFS_CIRCULAR_QUEUE_PRIO
+/// private function that writes size zero bytes at the current position. SPIFFS can't seek past the file end
+static uint8_t _fill_medium(FILE *fd, const uint32_t size);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+/// private fwrite counterpart counting medium writes and cutting the power when armed
+static size_t _fault_fwrite(const void *data, const size_t size, const size_t count, FILE *fd);
+/// private function that keeps the programmed content of the page a write ends in, unless it's kept already
+static void _fault_page_keep(FILE *fd, const uint32_t page);
+#endif
+/// private function that closes pooled handles of an owner, or all if owner is NULL. Handles must not be in use
+static void _pool_evict(const void *owner);
+#if CIRCULAR_QUEUE_REGISTRY
+/// private function that adds a queue to the registry, if not there yet
+static uint8_t _registry_add(circular_queue_t *cq);
+/// private function that removes a queue from the registry
+static void _registry_remove(const circular_queue_t *cq);
+#endif
+/// private function that creates registry and pool sync objects
+static uint8_t _registry_start(void);
+/// private function that runs start_func once. Concurrent callers wait for it, a failed start is retried
+static uint8_t _call_once(std::atomic<uint8_t> *state, uint8_t (*start_func)(void));
+
+/// private non-locking versions of the public size and available space functions
+static uint32_t _size(const circular_queue_t *cq);
+static uint32_t _available_space(const circular_queue_t *cq);
+
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+/// private function that checks whether the partition stays under the high-water mark after growing by growth bytes
+static uint8_t _space_admit(const uint32_t growth);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+/// private function that updates the watermarks state on a fill level change. Called with the state lock held
+static void _watermark_check(circular_queue_t *cq);
+/// private function that calls the watermark callback for the crossings not reported yet. Called without the state
+///   lock and the queue file handle
+static void _watermark_fire(circular_queue_t *cq);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+/// private function that waits for event up to the timeout counted from start. Returns 0 if the time is over
+static uint8_t _wait_event(const circular_queue_t *cq, const EventBits_t event, const TickType_t start, const TickType_t timeout);
+/// private function that converts a timeout in milliseconds to ticks, portMAX_DELAY if it doesn't fit in a TickType_t
+static inline TickType_t _wait_ticks(const uint32_t timeout_ms);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+/// private function that finds room for a record of need bytes in the RAM ring. Producer side
+static uint32_t _frontend_reserve(circular_queue_frontend_t *fe, const uint32_t need);
+/// private function that locates the oldest record in the RAM ring. Consumer side
+static uint8_t _frontend_peek(circular_queue_frontend_t *fe, uint32_t *pos, uint16_t *size);
+/// private flush task body
+static void _frontend_flush_task(void *arg);
+/// private function that stops the flush task and releases the RAM ring
+static void _frontend_free(circular_queue_t *cq);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+/// private function that starts the I/O worker task
+static uint8_t _async_start(void);
+/// private function that hands an operation over to the I/O worker task
+static uint8_t _async_submit(const circular_queue_async_op_t *op);
+/// private I/O worker task body
+static void _async_io_task(void *arg);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND || SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+/// private function that locates the next elem buffered in RAM, staged ones first. Consumer side
+static uint8_t _buffered_peek(const circular_queue_t *cq, const uint8_t **elem, uint16_t *size, circular_queue_buffered_t *origin);
+/// private function that releases the elem returned by _buffered_peek. Consumer side
+static void _buffered_release(circular_queue_t *cq, const circular_queue_buffered_t origin);
+/// private function that moves elems buffered in RAM to the queue file in batches. Consumer side
+static uint8_t _buffered_drain(circular_queue_t *cq);
+#endif
+
+/// Consume read buffer, front relative
+typedef struct {
+    uint8_t buf[SPIFFS_CIRCULAR_QUEUE_CONSUME_BUFFER_SIZE];
+    uint32_t start;                 ///< Buffered data index, relative to the queue front
+    uint32_t len;                   ///< Buffered bytes
+} circular_queue_consume_window_t;
+
+/// private function that makes the window hold need bytes at pos past front_idx, reading ahead up to used bytes
+static uint8_t _consume_window(const circular_queue_t *cq, FILE *fd, circular_queue_consume_window_t *win, 
+                               const uint32_t front_idx, const uint32_t pos, const uint32_t need, const uint32_t used);
+/// private function that reads size bytes at the queue index idx, joining data split over the file end
+static uint32_t _read_ring(const circular_queue_t *cq, FILE *fd, const uint32_t idx, void *data, const uint32_t size);
+/// private function that drops count elems of size bytes from the front and persists. Dequeue lock must be held
+static uint8_t _dequeue_commit(circular_queue_t *cq, FILE *fd, const uint32_t size, const uint16_t count);
+/// private function that gets the queue data bytes, size prefixes included. State lock must be held
+static inline uint32_t _used(const circular_queue_t *cq);
+
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+/// Recovery scan read cache
+typedef struct {
+    uint8_t buf[SPIFFS_CIRCULAR_QUEUE_SCAN_CHUNK];
+    uint32_t start;                 ///< Cached data index
+    uint32_t len;                   ///< Cached bytes
+} circular_queue_scan_cache_t;
+
+/// private function that walks elems from front to back index and cuts the header down to the last consistent one
+static uint8_t _recovery_scan(circular_queue_t *cq, FILE *fd);
+/// private function that reads a data byte through the scan cache, refilled with large sequential reads
+static uint8_t _scan_byte(const circular_queue_t *cq, FILE *fd, circular_queue_scan_cache_t *cache, 
+                          const uint32_t idx, uint8_t *byte);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+/// private function that writes the cursors part of the queue header
+static uint8_t _cursors_write(const circular_queue_t *cq, FILE *fd);
+/// private function that reads the cursors part of the queue header
+static uint8_t _cursors_read(circular_queue_t *cq, FILE *fd);
+/// private function that tells if any cursor is registered
+static uint8_t _cursors_in_use(const circular_queue_t *cq);
+/// private function that moves the queue front to the slowest cursor. State lock must be held
+static void _cursors_reclaim(circular_queue_t *cq);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+#define CIRCULAR_QUEUE_BLOCK_HDR_SIZE       (sizeof(uint16_t) + \
+                                            sizeof(uint32_t))   ///< Block header past the size prefix: elems count, CRC
+
+/// Block being filled, its header is written on the block write
+typedef struct {
+    uint16_t size;                  ///< Block size limit
+    uint16_t len;                   ///< Block bytes so far, header included
+    uint16_t count;                 ///< Elems in the block
+    uint8_t *data;                  ///< Block bytes
+} circular_queue_block_buffer_t;
+
+/// private function that allocates the block being filled of a block format queue
+static uint8_t _block_start(circular_queue_t *cq);
+/// private function that writes the block being filled as one queue elem and empties it. Enqueue lock must be held
+static uint8_t _block_write(circular_queue_t *cq, circular_queue_block_buffer_t *blk);
+/// private function that computes a block CRC over its elems count and elems
+static uint32_t _block_crc(const uint8_t *block, const uint16_t len);
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+/// private function that checks the CRC of the block at the queue index idx, total bytes long with its size prefix
+static uint8_t _scan_block_crc(const circular_queue_t *cq, FILE *fd, circular_queue_scan_cache_t *cache, 
+                               const uint32_t idx, const uint32_t total);
+#endif
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+/// private function that writes the changed parts of the container header: free blocks, queues and chain links
+static uint8_t _multi_persist(circular_queue_multi_t *mq, FILE *fd);
+/// private function that writes the queue_id queue record of the container header
+static uint8_t _multi_lane_write(const circular_queue_multi_t *mq, FILE *fd, const uint8_t queue_id);
+/// private function that reads the container header, it fails if the file has another geometry
+static uint8_t _multi_load(circular_queue_multi_t *mq, FILE *fd);
+/// private function that takes the batch file handle or one from the pool. Container lock must be held
+static FILE *_multi_open(circular_queue_multi_t *mq);
+/// private function that persists a changed header and gives the handle back, unless it belongs to a batch
+static uint8_t _multi_close(circular_queue_multi_t *mq, FILE *fd);
+/// private function that reads or writes size bytes at a blocks chain position, following the chain links
+static uint8_t _multi_io(const circular_queue_multi_t *mq, FILE *fd, uint16_t *blk, uint16_t *off, 
+                         void *data, const uint16_t size, const uint8_t write);
+/// private function that reads the front elem of a logical queue, the position past it is returned in blk and off
+static uint8_t _multi_read(const circular_queue_multi_t *mq, FILE *fd, const circular_queue_lane_t *lane, 
+                           void *elem, uint16_t *elem_size, uint16_t *blk, uint16_t *off);
+/// private function that puts a block at the head of the free chain
+static inline void _multi_release(circular_queue_multi_t *mq, const uint16_t blk);
+/// private function that sets the chain link of a block, marking it for the next persist
+static inline void _multi_link(circular_queue_multi_t *mq, const uint16_t blk, const uint16_t next);
+/// private function that returns the container data area file offset
+static inline uint32_t _multi_data_offset(const circular_queue_multi_t *mq);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+#define CIRCULAR_QUEUE_PRIO_HDR_FIXED       (sizeof(uint8_t)*2)     ///< Priority queue header fixed part: flags, levels count
+#define CIRCULAR_QUEUE_PRIO_LEVEL_HDR       (sizeof(uint32_t)*3 + \
+                                            sizeof(uint16_t))       ///< Level header: front, back, max size, count
+
+/// private function that writes the combined header of all levels
+static uint8_t _prio_persist(const circular_queue_prio_t *pq, FILE *fd);
+/// private function that reads the combined header, it fails if the file has other levels
+static uint8_t _prio_load(circular_queue_prio_t *pq, FILE *fd);
+/// private function that reads the front elem of the highest non-empty level, its index past the elem is returned
+static uint8_t _prio_read(const circular_queue_prio_t *pq, FILE *fd, void *elem, uint16_t *elem_size, 
+                          uint8_t *level, uint32_t *idx);
+/// private function that reads or writes size bytes at idx of a ring region, wrapping around its end
+static uint8_t _ring_io(FILE *fd, const uint32_t region, const uint32_t region_size, uint32_t *idx, 
+                        void *data, const uint16_t size, const uint8_t write);
+/// private function that returns a level used bytes
+static inline uint32_t _prio_level_used(const circular_queue_level_t *lvl);
+/// private function that returns a level ring region file offset
+static inline uint32_t _prio_level_offset(const circular_queue_prio_t *pq, const uint8_t level);
+#endif
 
 static inline uint32_t _spiffs_circular_queue_full_size(const circular_queue_t *cq);
 static inline uint8_t _circular_queue_get_data_offset(const circular_queue_t *cq);
 
 uint8_t spiffs_circular_queue_init(circular_queue_t *cq) {
-    uint8_t ret = 1;
+    uint8_t ret = _call_once(&_registry_state, _registry_start);
+#if SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE
+    uint32_t phase_start = micros();
+
+    memset(&cq->init_profile, 0x0, sizeof(cq->init_profile));
+#endif
 
     if (ret && !esp_spiffs_mounted(NULL)) {
         ret = _mount_spiffs();
+        CIRCULAR_QUEUE_INIT_PHASE(cq, mount_us, phase_start);
     }
 
     if (ret) {
@@ -44,36 +457,70 @@ uint8_t spiffs_circular_queue_init(circular_queue_t *cq) {
         FILE *fd = NULL;
 
         // stat returns 0 upon succes (file exists) and -1 on failure (does not)
-        if (stat(cq->fn, &sb) < 0) {
-            if ((fd = fopen(cq->fn, "w"))) {
+        uint8_t exists = stat(cq->fn, &sb) == 0;
+        CIRCULAR_QUEUE_INIT_PHASE(cq, stat_us, phase_start);
+
+        if (!exists) {
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+            // a new file is admitted only if it fits the headroom once full, existing ones are opened anyway
+            ret = spiffs_circular_queue_get_headroom() >= 
+                (cq->max_size? cq->max_size : CIRCULAR_QUEUE_DEFAULT_MAX_SIZE) + CIRCULAR_QUEUE_HEADER_MAX_SIZE;
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+            // blocks hold variable size elems
+            if (cq->block_size && cq->elem_size) ret = 0;
+#endif
+            if (ret && (fd = _open_medium(cq, 1))) {
+                CIRCULAR_QUEUE_INIT_PHASE(cq, open_us, phase_start);
 
                 cq->front_idx = cq->back_idx = 0;
                 cq->count = 0;
 
                 // set fixed elem size flags bit
                 cq->flags.fields.fixed_elem_size = cq->elem_size > 0;
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+                cq->recovery_us = 0;
+                cq->recovered = 0;
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+                // the file has room for cursors on request only, none registered yet
+                cq->flags.fields.cursors = cq->use_cursors > 0;
+                memset(cq->cursors, 0x0, sizeof(cq->cursors));
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+                cq->flags.fields.blocks = cq->block_size > 0;
+#endif
                 
                 // set default max size, if not specified
                 if (!cq->max_size) cq->max_size = CIRCULAR_QUEUE_DEFAULT_MAX_SIZE;
 
                 // set front and back indices in the file's head
-                uint8_t nwritten = fwrite(&(cq->front_idx), 1, sizeof(cq->front_idx), fd);
-                nwritten += fwrite(&(cq->back_idx), 1, sizeof(cq->back_idx), fd);
-                nwritten += fwrite(&(cq->count), 1, sizeof(cq->count), fd);
-                nwritten += fwrite(&(cq->max_size), 1, sizeof(cq->max_size), fd);
-                nwritten += fwrite(&(cq->flags.value), 1, sizeof(cq->flags.value), fd);
+                uint8_t nwritten = CIRCULAR_QUEUE_FWRITE(&(cq->front_idx), 1, sizeof(cq->front_idx), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->back_idx), 1, sizeof(cq->back_idx), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->count), 1, sizeof(cq->count), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->max_size), 1, sizeof(cq->max_size), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->flags.value), 1, sizeof(cq->flags.value), fd);
                 if (cq->elem_size) { // if fixed elem size
-                    nwritten += fwrite(&(cq->elem_size), 1, sizeof(cq->elem_size), fd);
+                    nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->elem_size), 1, sizeof(cq->elem_size), fd);
                 }
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+                if (cq->flags.fields.cursors && _cursors_write(cq, fd)) nwritten += CIRCULAR_QUEUE_CURSORS_TABLE_SIZE;
+#endif
                 
                 ret = nwritten == _circular_queue_get_data_offset(cq);
-                fclose(fd);
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+                cq->file_size = nwritten;
+#endif
+                _pool_close(fd); // the queue sync objects may not exist yet
+                CIRCULAR_QUEUE_INIT_PHASE(cq, header_us, phase_start);
             } else {
                 ret = 0;
             }
         } else {
-            if ((fd = fopen(cq->fn, "r+b"))) {
+            if ((fd = _open_medium(cq, 0))) {
+                CIRCULAR_QUEUE_INIT_PHASE(cq, open_us, phase_start);
                 // read front and back indices from the file's head
+                fseek(fd, 0, SEEK_SET);
                 uint8_t nread = fread(&(cq->front_idx), 1, sizeof(cq->front_idx), fd);
                 nread += fread(&(cq->back_idx), 1, sizeof(cq->back_idx), fd);
                 nread += fread(&(cq->count), 1, sizeof(cq->count), fd);
@@ -82,16 +529,74 @@ uint8_t spiffs_circular_queue_init(circular_queue_t *cq) {
                 if (cq->flags.fields.fixed_elem_size) {
                     nread += fread(&(cq->elem_size), 1, sizeof(cq->elem_size), fd);
                 }
+                // a file with cursors is read only with cursors support
+                if (cq->flags.fields.cursors) {
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+                    if (_cursors_read(cq, fd)) nread += CIRCULAR_QUEUE_CURSORS_TABLE_SIZE;
+#else
+                    nread = 0;
+#endif
+                }
 
                 ret = nread == _circular_queue_get_data_offset(cq);
-                fclose(fd);
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+                cq->file_size = sb.st_size;
+#endif
+                CIRCULAR_QUEUE_INIT_PHASE(cq, header_us, phase_start);
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+                if (ret) {
+                    uint32_t start = micros();
+
+                    ret = _recovery_scan(cq, fd);
+                    cq->recovery_us = micros() - start;
+                }
+#endif
+                _pool_close(fd);
             } else {
                 ret = 0;
             }
         }
     }
 
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    // the header is as on the flash, deferred mode is kept over re-initialization
+    cq->dirty = 0;
+    cq->freed = 0;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    if (ret) {
+        // locks survive re-initialization, create them only once
+        if (!cq->mutex) cq->mutex = xSemaphoreCreateMutex();
+        if (!cq->enqueue_mutex) cq->enqueue_mutex = xSemaphoreCreateMutex();
+        if (!cq->dequeue_mutex) cq->dequeue_mutex = xSemaphoreCreateMutex();
+
+        ret = cq->mutex && cq->enqueue_mutex && cq->dequeue_mutex;
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+        if (!cq->events) cq->events = xEventGroupCreate();
+        ret = ret && cq->events;
+#endif
+    }
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    // the block being filled survives re-initialization
+    if (ret && cq->flags.fields.blocks && !cq->block) {
+        ret = _block_start(cq);
+    }
+    cq->dropped = 0;
+#endif
+
+#if CIRCULAR_QUEUE_REGISTRY
+    if (ret) {
+        ret = _registry_add(cq);
+    }
+#endif
+
     if (ret) {
+        // the header just read may put the front anywhere, frames read before are stale
+        cq->dequeue_seq++;
+
         cq->front = spiffs_circular_queue_front;
         cq->enqueue = spiffs_circular_queue_enqueue;
         cq->dequeue = spiffs_circular_queue_dequeue;
@@ -111,274 +616,2821 @@ uint8_t spiffs_circular_queue_init(circular_queue_t *cq) {
 uint8_t spiffs_circular_queue_front(const circular_queue_t *cq, void *elem, uint16_t *elem_size) {
     uint8_t ret = 0;
 
+    // front elem can't be dequeued by others while dequeue lock is held
+    CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
     if (!spiffs_circular_queue_is_empty(cq)) {
-        ret = _read_medium(cq, elem, elem_size);
+        FILE *fd = NULL;
+
+        if ((fd = _open_medium(cq, 0))) {
+            ret = _read_medium(cq, fd, cq->front_idx, elem, elem_size);
+            _pool_close(fd); // the fill level is untouched
+        }
     }
+    CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
 
     return ret;
 }
 
 uint8_t spiffs_circular_queue_enqueue(circular_queue_t *cq, const void *elem, const uint16_t elem_size) {
-    uint8_t ret = 0;
-    uint32_t enqueue_size = cq->elem_size? cq->elem_size : elem_size;
-
-    if (enqueue_size && spiffs_circular_queue_available_space(cq) >= enqueue_size &&
-        (!SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE ||
-        (SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE && enqueue_size < SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE))
-    ) {
-        if (_write_medium(cq, elem, elem_size)) {
-            enqueue_size += cq->elem_size? 0 : sizeof(elem_size);
+    circular_queue_iovec_t iov = _iov_single(cq, elem, elem_size);
 
-            cq->back_idx = (cq->back_idx + enqueue_size) % cq->max_size;
-            cq->count++;
-            ret = _spiffs_circular_queue_persist(cq);
-        }
-    }
+    return _enqueue_file(cq, &iov, 1, _persist_or_defer);
+}
 
-    return ret;
+uint8_t spiffs_circular_queue_enqueuev(circular_queue_t *cq, const circular_queue_iovec_t *iov, const uint8_t iovcnt) {
+    return iov && iovcnt && _enqueue_file(cq, iov, iovcnt, _persist_or_defer);
 }
 
-uint8_t spiffs_circular_queue_dequeue(circular_queue_t *cq, void *elem, uint16_t *elem_size) {
+uint8_t spiffs_circular_queue_enqueue_with(circular_queue_t *cq, const uint16_t max_len, 
+                                           circular_queue_writer_cb_t writer_cb, void *ctx) {
     uint8_t ret = 0;
 
-    if (!spiffs_circular_queue_is_empty(cq)) {
-        if (_read_medium(cq, elem, elem_size)) {
-            uint16_t dequeued_size = cq->elem_size? cq->elem_size : (sizeof(*elem_size) + *elem_size);
+    CIRCULAR_QUEUE_LOCK(cq->enqueue_mutex);
+    FILE *fd = NULL;
+
+    if (writer_cb && (fd = _open_medium(cq, 0))) {
+        uint16_t limit = cq->elem_size? cq->elem_size : max_len;
+
+        // room for the largest elem, the writer can't run over unread elems
+        if (_enqueue_admit(cq, fd, 0, limit)) {
+            circular_queue_writer_t writer = {cq, fd, cq->back_idx, 0, limit, 0};
+            uint16_t prefix = 0;
+
+            fseek(fd, _circular_queue_get_data_offset(cq) + writer.idx, SEEK_SET);
+            // the size prefix is not known yet, its place is taken first. SPIFFS can't seek past the file end
+            if (!cq->elem_size) writer.failed = _write_ring(cq, fd, &writer.idx, &prefix, sizeof(prefix)) != sizeof(prefix);
+
+            if (!writer.failed && writer_cb(&writer, ctx) && !writer.failed && writer.written && 
+                (!cq->elem_size || writer.written == limit)
+            ) {
+                uint32_t idx = cq->back_idx;
+                uint8_t framed = 1;
 
-            cq->front_idx = (cq->front_idx + dequeued_size) % cq->max_size;
-            cq->count--;
-            ret = _spiffs_circular_queue_persist(cq);
+                if (!cq->elem_size) {
+                    prefix = writer.written;
+                    fseek(fd, _circular_queue_get_data_offset(cq) + idx, SEEK_SET);
+                    framed = _write_ring(cq, fd, &idx, &prefix, sizeof(prefix)) == sizeof(prefix);
+                }
+                if (framed && _enqueue_commit(cq, fd, writer.written + (cq->elem_size? 0 : sizeof(prefix)), 1)) {
+                    CIRCULAR_QUEUE_LOCK(cq->mutex);
+                    ret = _persist_or_defer(cq, fd);
+                    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+                }
+            }
         }
+        _close_medium(cq, fd);
     }
+    CIRCULAR_QUEUE_UNLOCK(cq->enqueue_mutex);
 
     return ret;
 }
 
-uint8_t spiffs_circular_queue_is_empty(const circular_queue_t *cq) {
-    return !cq->count;
+uint8_t spiffs_circular_queue_writer_put(circular_queue_writer_t *writer, const void *data, const uint16_t size) {
+    uint8_t ret = !writer->failed && (data || !size) && (uint32_t)writer->written + size <= writer->max_len;
+
+    if (ret) {
+        ret = _write_ring(writer->cq, writer->fd, &writer->idx, data, size) == size;
+        writer->written += size;
+    }
+    writer->failed = !ret;
+
+    return ret;
 }
 
-uint32_t spiffs_circular_queue_size(const circular_queue_t *cq) {
-    uint32_t qsize = 0;
+uint8_t spiffs_circular_queue_dequeue(circular_queue_t *cq, void *elem, uint16_t *elem_size) {
+    uint8_t ret = 0;
 
-    uint32_t elem_size_total = cq->elem_size? 0 : cq->count*sizeof(uint16_t);
+    CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
+    if (!spiffs_circular_queue_is_empty(cq)) {
+        FILE *fd = NULL;
 
-    if (cq->back_idx > cq->front_idx) {
-        qsize = cq->back_idx - cq->front_idx - elem_size_total;
-    } else if (cq->back_idx < cq->front_idx) {
-        qsize = cq->max_size - cq->front_idx + cq->back_idx - elem_size_total;
-    } else if (cq->count) { // && indices are equal
-        qsize = cq->max_size - elem_size_total;
+        if ((fd = _open_medium(cq, 0))) {
+            if (_dequeue_medium(cq, fd, elem, elem_size)) {
+                CIRCULAR_QUEUE_LOCK(cq->mutex);
+                ret = _persist_or_defer(cq, fd);
+                CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+            }
+            _close_medium(cq, fd);
+        }
     }
+    CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
 
-    return qsize;
+    return ret;
 }
 
-uint32_t spiffs_circular_queue_available_space(const circular_queue_t *cq) {
-    uint32_t elem_size_total = 0;
-    uint16_t next_elem_size = 0;
+uint16_t spiffs_circular_queue_consume(circular_queue_t *cq, const uint16_t max_elems, circular_queue_consume_cb_t cb, 
+                                       void *ctx) {
+    uint16_t ret = 0;
 
-    if (!cq->elem_size) { // if variable elem size
-        elem_size_total = cq->count*sizeof(uint16_t);
-        next_elem_size = sizeof(uint16_t);
-    }
+    CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
+    FILE *fd = NULL;
 
-    uint32_t gross_available_space = cq->max_size - 
-                                (spiffs_circular_queue_size(cq) + elem_size_total);
+    if (cb && !spiffs_circular_queue_is_empty(cq) && (fd = _open_medium(cq, 0))) {
+        circular_queue_consume_window_t win;
+        uint32_t front_idx = cq->front_idx;
+        uint32_t pos = 0;
+        uint8_t more = 1;
 
-    return gross_available_space <= next_elem_size ? 0 : gross_available_space - next_elem_size;
-}
+        win.start = win.len = 0;
 
-uint32_t spiffs_circular_queue_get_front_idx(const circular_queue_t *cq) {
-    return cq->front_idx;
-}
+        // elems enqueued meanwhile are left for the next call
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        uint16_t count = cq->count;
+        uint32_t used = _used(cq);
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
 
-uint32_t spiffs_circular_queue_get_back_idx(const circular_queue_t *cq) {
-    return cq->back_idx;
-}
+        while (more && ret < max_elems && ret < count) {
+            uint16_t size = cq->elem_size;
+            uint8_t prefix = cq->elem_size? 0 : sizeof(size);
 
-uint16_t spiffs_circular_queue_get_count(const circular_queue_t *cq) {
-    return cq->count;
-}
+            if (prefix && (more = _consume_window(cq, fd, &win, front_idx, pos, prefix, used))) {
+                memcpy(&size, &win.buf[pos - win.start], prefix);
+            }
+            if (more && size > sizeof(win.buf)) {
+                // an elem larger than the read buffer is read on its own into the heap
+                uint8_t *elem = pos + prefix + size <= used? (uint8_t *)malloc(size) : NULL;
+                more = elem && _read_ring(cq, fd, (front_idx + pos + prefix) % cq->max_size, elem, size) == size &&
+                    cb(elem, size, ctx);
+                free(elem);
+            } else {
+                more = more && size && _consume_window(cq, fd, &win, front_idx, pos + prefix, size, used) &&
+                    cb(&win.buf[pos + prefix - win.start], size, ctx);
+            }
+            if (more) {
+                pos += prefix + size;
+                ret++;
+            }
+        }
 
-uint32_t spiffs_circular_queue_get_file_size(const circular_queue_t *cq) {
-    struct stat sb;
+        // accepted elems are dequeued at once
+        if (ret) _dequeue_commit(cq, fd, pos, ret);
+        _close_medium(cq, fd);
+    }
+    CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
 
-    return stat(cq->fn, &sb) < 0 ? 0 : sb.st_size;
+    return ret;
 }
 
-uint8_t spiffs_circular_queue_free(circular_queue_t *cq, const uint8_t unmount_spiffs) {
-    uint8_t ret = 0;
+static uint8_t _consume_window(const circular_queue_t *cq, FILE *fd, circular_queue_consume_window_t *win, 
+                               const uint32_t front_idx, const uint32_t pos, const uint32_t need, const uint32_t used) {
+    uint8_t ret = pos >= win->start && pos + need <= win->start + win->len;
 
-    if (!remove(cq->fn)) {
-        ret = 1;
-        if (unmount_spiffs) ret = _unmount_spiffs();
-        memset(cq, 0x0, sizeof(circular_queue_t));
+    if (!ret && need <= sizeof(win->buf) && pos + need <= used) {
+        uint32_t len = used - pos < sizeof(win->buf)? used - pos : sizeof(win->buf);
+
+        win->start = pos;
+        win->len = _read_ring(cq, fd, (front_idx + pos) % cq->max_size, win->buf, len);
+        ret = pos + need <= win->start + win->len;
     }
 
     return ret;
 }
 
-#define SPIFFS_CIRCULAR_QUEUE_PERSIST_SIZE  (sizeof(uint32_t)*2 + sizeof(uint16_t)) ///< Persist bytes
-static uint8_t _spiffs_circular_queue_persist(const circular_queue_t *cq) {
-    FILE *fd = NULL;
-    uint8_t nwritten = 0;
+// not null-pointer safe
+static uint32_t _read_ring(const circular_queue_t *cq, FILE *fd, const uint32_t idx, void *data, const uint32_t size) {
+    uint32_t first = cq->max_size - idx < size? cq->max_size - idx : size; // up to the file end
+    uint32_t nread = fseek(fd, _circular_queue_get_data_offset(cq) + idx, SEEK_SET)? 0 : fread(data, 1, first, fd);
 
-    if ((fd = fopen(cq->fn, "r+b"))) {
-        // write front_idx and back indices to the file's head
-        nwritten += fwrite(&(cq->front_idx), 1, sizeof(cq->front_idx), fd);
-        nwritten += fwrite(&(cq->back_idx), 1, sizeof(cq->back_idx), fd);
-        nwritten += fwrite(&(cq->count), 1, sizeof(cq->count), fd);
-    
-        fclose(fd);
+    if (nread == first && size > first && !fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET)) {
+        nread += fread(&((uint8_t *)data)[first], 1, size - first, fd);
     }
-    
-    return (nwritten == SPIFFS_CIRCULAR_QUEUE_PERSIST_SIZE);
+
+    return nread;
 }
 
-static uint8_t _mount_spiffs(void) {
-    esp_vfs_spiffs_conf_t conf = {
-        .base_path = "/spiffs",
-        .partition_label = NULL,
-        .max_files = SPIFFS_MAX_FILES_COUNT,
-        .format_if_mount_failed = false
-    };
-    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+// not null-pointer safe
+static uint8_t _dequeue_commit(circular_queue_t *cq, FILE *fd, const uint32_t size, const uint16_t count) {
+    CIRCULAR_QUEUE_LOCK(cq->mutex);
+    cq->front_idx = (cq->front_idx + size) % cq->max_size;
+    cq->count -= count;
+    cq->dequeue_seq++;
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    cq->freed += size;
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+    // the elems are dropped for all cursors
+    for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+        if (cq->cursors[i].name[0]) cq->cursors[i].ahead = cq->cursors[i].ahead > count? cq->cursors[i].ahead - count : 0;
+    }
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+    _watermark_check(cq);
+#endif
+    uint8_t ret = _persist_or_defer(cq, fd);
+    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+    CIRCULAR_QUEUE_SIGNAL(cq, CIRCULAR_QUEUE_EVENT_SPACE);
 
-    return (ret == ESP_OK);
+    return ret;
 }
 
-static uint8_t _unmount_spiffs(void) {
-    return (esp_vfs_spiffs_unregister(NULL) == ESP_OK);
+static inline uint32_t _used(const circular_queue_t *cq) {
+    return _size(cq) + (cq->elem_size? 0 : cq->count*sizeof(uint16_t));
 }
 
-// not null-pointer safe
-static uint8_t _write_medium(const circular_queue_t *cq, const void *data, const uint16_t data_size) {
-    // spiffs medium
+uint8_t spiffs_circular_queue_dequeue_frame(circular_queue_t *cq, void *buf, const uint32_t mtu, circular_queue_frame_t *frame) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
     FILE *fd = NULL;
-    uint16_t nwritten = 0;
 
-    if ((fd = fopen(cq->fn, "r+b"))) {
-        uint32_t next_back_idx = _circular_queue_get_data_offset(cq) + cq->back_idx;
-        fseek(fd, next_back_idx, SEEK_SET);
-
-        if (!cq->elem_size) { // if fixed elem size
-            // case 1: split elem size
-            if (next_back_idx + sizeof(data_size) > _spiffs_circular_queue_full_size(cq)) {
-                uint8_t buf[sizeof(data_size)];
-                // transform data_size into byte array
-                memcpy(buf, &data_size, sizeof(data_size));
-                // write first part of data_size
-                nwritten = fwrite(buf, 1, _spiffs_circular_queue_full_size(cq) - next_back_idx, fd);
-                // set seek to the first usable byte
-                fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
-                // write the rest of data_size
-                nwritten += fwrite(&buf[cq->max_size - cq->back_idx], 1, 
-                    sizeof(data_size) - (cq->max_size - cq->back_idx), fd);
-                next_back_idx = _circular_queue_get_data_offset(cq) + sizeof(data_size) - (cq->max_size - cq->back_idx);
-            } else { // normal write
-                nwritten = fwrite(&data_size, 1, sizeof(data_size), fd);
-                next_back_idx += sizeof(data_size);
-            }
-        }
-        // case 2: split elem data
-        if (data) {
-            uint16_t write_size = cq->elem_size? cq->elem_size : data_size;
+    if (buf && frame && !spiffs_circular_queue_is_empty(cq) && (fd = _open_medium(cq, 0))) {
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        uint16_t count = cq->count;
+        uint32_t used = _used(cq);
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
 
-            if (next_back_idx + write_size > _spiffs_circular_queue_full_size(cq)) {
-                uint8_t *data_bp = (uint8_t *)data; // byte-pointer
+        frame->seq = cq->dequeue_seq;
+        frame->count = 0;
+        frame->size = 0;
 
-                nwritten += fwrite(data_bp, 1, _spiffs_circular_queue_full_size(cq) - next_back_idx, fd);
-                fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
-                nwritten += fwrite(&data_bp[_spiffs_circular_queue_full_size(cq) - next_back_idx], 1, 
-                    write_size - (_spiffs_circular_queue_full_size(cq) - next_back_idx), fd);
-            } else { // normal write
-                nwritten += fwrite(data, 1, write_size, fd);
+        if (cq->elem_size) { // whole elems, no framing needed
+            frame->count = mtu/cq->elem_size < count? mtu/cq->elem_size : count;
+            frame->size = frame->count*cq->elem_size;
+            ret = frame->count && _read_ring(cq, fd, cq->front_idx, buf, frame->size) == frame->size;
+        } else {
+            // the ring holds size prefixed elems already, one read and the frame ends at the last whole elem
+            uint32_t nread = _read_ring(cq, fd, cq->front_idx, buf, mtu < used? mtu : used);
+            uint16_t size = 0;
+
+            while (frame->count < count && frame->size + sizeof(size) <= nread) {
+                memcpy(&size, &((uint8_t *)buf)[frame->size], sizeof(size));
+                if (frame->size + sizeof(size) + size > nread) break;
+                frame->size += sizeof(size) + size;
+                frame->count++;
             }
+            ret = frame->count > 0;
         }
-
-        fclose(fd);
+        _close_medium(cq, fd);
     }
+    CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
 
-    return (nwritten == (cq->elem_size? cq->elem_size : (sizeof(data_size) + data_size)));
+    return ret;
 }
 
-// read only non-null-pointer data and data_size. null-poiner safe
-static uint8_t _read_medium(const circular_queue_t *cq, void *data, uint16_t *data_size) {
-    // spiffs medium
-    uint8_t ret = 1;
+uint8_t spiffs_circular_queue_frame_commit(circular_queue_t *cq, const circular_queue_frame_t *frame) {
+    uint8_t ret = 0;
 
+    CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
     FILE *fd = NULL;
-    uint16_t nread = 0;
 
-    if ((fd = fopen(cq->fn, "r+b"))) {
-        uint32_t next_front_idx = _circular_queue_get_data_offset(cq) + cq->front_idx;
-        fseek(fd, next_front_idx, SEEK_SET);
-
-        if (!cq->elem_size) { // if fixed elem size
-            if (data_size) { // case 1: split elem size
-                if (next_front_idx + sizeof(*data_size) > _spiffs_circular_queue_full_size(cq)) {
-                    uint8_t buf[sizeof(*data_size)];
-                    // read first half
-                    nread = fread(buf, 1, cq->max_size - cq->front_idx, fd);
-                    // set seek to the first usable byte
-                    fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
-                    // read the rest of size
-                    nread += fread(&buf[cq->max_size - cq->front_idx], 1, sizeof(*data_size) - (cq->max_size - cq->front_idx), fd);
-                    // transform read by bytes data_size into uint16_t
-                    memcpy(data_size, buf, sizeof(*data_size));
-                    next_front_idx = _circular_queue_get_data_offset(cq) + sizeof(*data_size) - (cq->max_size - cq->front_idx);
-                } else { // normal read
-                    nread = fread(data_size, 1, sizeof(*data_size), fd);
-                    next_front_idx += sizeof(*data_size);
-                }
-            } else {
-                ret = 0;
-            }
-        }
-
-        if (data) {
-            uint16_t read_size = cq->elem_size? cq->elem_size : *data_size;
-
-            // case 2: split elem data
-            if (next_front_idx + read_size > _spiffs_circular_queue_full_size(cq)) {
-                uint8_t *data_bp = (uint8_t *)data; // byte-pointer
-
-                nread += fread(data_bp, 1, _spiffs_circular_queue_full_size(cq) - next_front_idx, fd);
-                // set seek to the first usable byte
-                fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
-                // read the rest of data
-                nread += fread(&data_bp[_spiffs_circular_queue_full_size(cq) - next_front_idx], 1, 
-                    read_size - (_spiffs_circular_queue_full_size(cq) - next_front_idx), fd);
-            } else { // normal read
-                nread += fread(data, 1, read_size, fd);
-            }
-        } else {
-            ret = 0;
-        }
-
-        fclose(fd);
-    }
-
-    if (ret) { // pointer validity checked
-        // check read bytes size
-        uint16_t exp_read_size = cq->elem_size? cq->elem_size : (sizeof(*data_size) + *data_size);
-        ret = nread == exp_read_size;
+    // the frame elems must still be at the queue front, the front index alone comes round on a wrap
+    if (frame && frame->count && frame->seq == cq->dequeue_seq && frame->count <= cq->count && 
+        (fd = _open_medium(cq, 0))
+    ) {
+        ret = _dequeue_commit(cq, fd, frame->size, frame->count);
+        _close_medium(cq, fd);
     }
+    CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
 
     return ret;
 }
 
-static inline uint32_t _spiffs_circular_queue_full_size(const circular_queue_t *cq) {
-    return (cq->max_size + _circular_queue_get_data_offset(cq));
+uint8_t spiffs_circular_queue_is_empty(const circular_queue_t *cq) {
+    return !cq->count;
 }
 
-static inline uint8_t _circular_queue_get_data_offset(const circular_queue_t *cq) {
-    uint8_t ret = CIRCULAR_QUEUE_DATA_OFFSET_FIXED;
+uint32_t spiffs_circular_queue_size(const circular_queue_t *cq) {
+    CIRCULAR_QUEUE_LOCK(cq->mutex);
+    uint32_t qsize = _size(cq);
+    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
 
-    if (cq->flags.fields.fixed_elem_size) {
-        ret += sizeof(uint16_t);
+    return qsize;
+}
+
+uint32_t spiffs_circular_queue_available_space(const circular_queue_t *cq) {
+    CIRCULAR_QUEUE_LOCK(cq->mutex);
+    uint32_t available_space = _available_space(cq);
+    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+
+    return available_space;
+}
+
+uint32_t spiffs_circular_queue_get_front_idx(const circular_queue_t *cq) {
+    return cq->front_idx;
+}
+
+uint32_t spiffs_circular_queue_get_back_idx(const circular_queue_t *cq) {
+    return cq->back_idx;
+}
+
+uint16_t spiffs_circular_queue_get_count(const circular_queue_t *cq) {
+    return cq->count;
+}
+
+uint32_t spiffs_circular_queue_get_file_size(const circular_queue_t *cq) {
+    struct stat sb;
+
+    return stat(cq->fn, &sb) < 0 ? 0 : sb.st_size;
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+uint32_t spiffs_circular_queue_get_recovery_time(const circular_queue_t *cq) {
+    return cq->recovery_us;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_IDLE_GC
+uint8_t spiffs_circular_queue_maintain(const circular_queue_t *cq, const uint32_t budget_ms) {
+    uint8_t ret = 1;
+    uint32_t start = millis();
+
+    CIRCULAR_QUEUE_LOCK(cq->mutex);
+    uint32_t footprint = cq->elem_size? cq->elem_size : 
+        (cq->count? _size(cq)/cq->count + sizeof(uint16_t) : SPIFFS_CIRCULAR_QUEUE_GC_STEP);
+    uint32_t available = _available_space(cq);
+    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+
+    uint32_t need = SPIFFS_CIRCULAR_QUEUE_GC_WRITES*footprint;
+    if (need > available) need = available;
+
+    // each step asks for one sector at most, a bounded amount of SPIFFS work. The budget is checked
+    //   between steps only, a step once started runs to its end
+    for (uint32_t freed = 0; ret && freed < need; freed += SPIFFS_CIRCULAR_QUEUE_GC_STEP) {
+        if (millis() - start >= budget_ms) {
+            ret = 0;
+        } else {
+            uint32_t step = need - freed < SPIFFS_CIRCULAR_QUEUE_GC_STEP? need - freed : SPIFFS_CIRCULAR_QUEUE_GC_STEP;
+            ret = esp_spiffs_gc(NULL, step) == ESP_OK;
+        }
+    }
+
+    return ret;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+uint32_t spiffs_circular_queue_get_headroom(void) {
+    uint32_t ret = 0;
+    size_t total = 0, used = 0;
+
+    if (esp_spiffs_info(NULL, &total, &used) == ESP_OK) {
+        uint64_t limit = (uint64_t)total*SPIFFS_CIRCULAR_QUEUE_HIGH_WATER_PCT/100;
+        uint64_t committed = used;
+
+        // queue files take the partition's used space so far and grow up to their full size
+        if (_registry_state == 2) {
+            CIRCULAR_QUEUE_LOCK(_registry_mutex);
+            for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE; i++) {
+                const circular_queue_t *q = _registry[i];
+                if (q && _spiffs_circular_queue_full_size(q) > q->file_size) {
+                    committed += _spiffs_circular_queue_full_size(q) - q->file_size;
+                }
+            }
+            CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+        }
+
+        ret = committed < limit? limit - committed : 0;
+    }
+
+    return ret;
+}
+
+static uint8_t _space_admit(const uint32_t growth) {
+    size_t total = 0, used = 0;
+
+    return esp_spiffs_info(NULL, &total, &used) == ESP_OK &&
+        ((uint64_t)used + growth)*100 <= (uint64_t)total*SPIFFS_CIRCULAR_QUEUE_HIGH_WATER_PCT;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+uint8_t spiffs_circular_queue_set_watermarks(circular_queue_t *cq, const uint32_t high, const uint32_t low, 
+                                             const circular_queue_watermark_unit_t unit, 
+                                             circular_queue_watermark_cb_t cb, void *ctx) {
+    uint8_t ret = !cb || low < high;
+
+    if (ret) {
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        cq->watermarks.high = high;
+        cq->watermarks.low = low;
+        cq->watermarks.unit = unit;
+        cq->watermarks.cb = cb;
+        cq->watermarks.ctx = ctx;
+        cq->watermarks.above = 0;
+        cq->watermarks.pending = 0;
+        // a level at high already is reported at once
+        _watermark_check(cq);
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+
+        _watermark_fire(cq);
+    }
+
+    return ret;
+}
+
+static void _watermark_check(circular_queue_t *cq) {
+    circular_queue_watermarks_t *wm = &cq->watermarks;
+
+    if (wm->cb) {
+        uint32_t level = wm->unit == CIRCULAR_QUEUE_WATERMARK_ELEMS? cq->count : _size(cq);
+
+        if ((!wm->above && level >= wm->high) || (wm->above && level <= wm->low)) {
+            wm->above = !wm->above;
+            wm->pending++;
+        }
+    }
+}
+
+static void _watermark_fire(circular_queue_t *cq) {
+    CIRCULAR_QUEUE_LOCK(cq->mutex);
+    circular_queue_watermark_cb_t cb = cq->watermarks.cb;
+    void *ctx = cq->watermarks.ctx;
+    uint8_t above = cq->watermarks.above;
+    uint8_t pending = cq->watermarks.pending;
+    cq->watermarks.pending = 0;
+    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+
+    // crossings alternate between high and low, the last one left the level where it is now
+    for (uint8_t i = pending; cb && i > 0; i--) {
+        cb(cq, (i % 2 == 1) == (above != 0)? CIRCULAR_QUEUE_WATERMARK_HIGH : CIRCULAR_QUEUE_WATERMARK_LOW, ctx);
+    }
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+uint8_t spiffs_circular_queue_dequeue_wait(circular_queue_t *cq, void *elem, uint16_t *elem_size, const uint32_t timeout_ms) {
+    uint8_t ret = 0;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = _wait_ticks(timeout_ms);
+
+    // the event is cleared before every try, an elem enqueued after a failed try sets it again
+    do {
+        xEventGroupClearBits(cq->events, CIRCULAR_QUEUE_EVENT_DATA);
+        ret = spiffs_circular_queue_dequeue(cq, elem, elem_size);
+    } while (!ret && _wait_event(cq, CIRCULAR_QUEUE_EVENT_DATA, start, timeout));
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_enqueue_wait(circular_queue_t *cq, const void *elem, const uint16_t elem_size, 
+                                           const uint32_t timeout_ms) {
+    uint8_t ret = 0;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = _wait_ticks(timeout_ms);
+    uint32_t footprint = cq->elem_size? cq->elem_size : (uint32_t)elem_size + sizeof(elem_size);
+
+    // an elem larger than the queue would wait forever
+    uint8_t fits = (cq->elem_size || elem_size) && footprint <= cq->max_size;
+
+    do {
+        xEventGroupClearBits(cq->events, CIRCULAR_QUEUE_EVENT_SPACE);
+        ret = fits && spiffs_circular_queue_enqueue(cq, elem, elem_size);
+    } while (!ret && fits && _wait_event(cq, CIRCULAR_QUEUE_EVENT_SPACE, start, timeout));
+
+    return ret;
+}
+
+static uint8_t _wait_event(const circular_queue_t *cq, const EventBits_t event, const TickType_t start, const TickType_t timeout) {
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    uint8_t ret = timeout == portMAX_DELAY || elapsed < timeout;
+
+    if (ret) {
+        xEventGroupWaitBits(cq->events, event, pdFALSE, pdFALSE, timeout == portMAX_DELAY? portMAX_DELAY : timeout - elapsed);
+    }
+
+    return ret;
+}
+
+static inline TickType_t _wait_ticks(const uint32_t timeout_ms) {
+    // pdMS_TO_TICKS multiplies in TickType_t, long timeouts would wrap to short ones
+    uint64_t ticks = (uint64_t)timeout_ms*configTICK_RATE_HZ/1000;
+
+    return (timeout_ms == CIRCULAR_QUEUE_WAIT_FOREVER || ticks >= portMAX_DELAY)? portMAX_DELAY : (TickType_t)ticks;
+}
+#endif
+
+uint8_t spiffs_circular_queue_free(circular_queue_t *cq, const uint8_t unmount_spiffs) {
+    uint8_t ret = 0;
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    // flush task must not touch the file anymore
+    _frontend_free(cq);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+    heap_caps_free(cq->staging);
+    cq->staging = NULL;
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    free(cq->block);
+    cq->block = NULL;
+#endif
+
+    // its file is not in use anymore
+#if CIRCULAR_QUEUE_REGISTRY
+    _registry_remove(cq);
+#endif
+    _pool_evict(cq);
+
+    if (!remove(cq->fn)) {
+        ret = 1;
+        if (unmount_spiffs) {
+            // other queues' handles don't survive unmount
+            _pool_evict(NULL);
+            ret = _unmount_spiffs();
+        }
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+        if (cq->mutex) vSemaphoreDelete(cq->mutex);
+        if (cq->enqueue_mutex) vSemaphoreDelete(cq->enqueue_mutex);
+        if (cq->dequeue_mutex) vSemaphoreDelete(cq->dequeue_mutex);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+        if (cq->events) vEventGroupDelete(cq->events);
+#endif
+        memset(cq, 0x0, sizeof(circular_queue_t));
+    }
+
+    return ret;
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+uint8_t spiffs_circular_queue_frontend_init(circular_queue_t *cq, const uint32_t ram_size) {
+    uint8_t ret = 0;
+    circular_queue_frontend_t *fe = NULL;
+
+    if (!cq->frontend && ram_size > CIRCULAR_QUEUE_FRONTEND_HDR_SIZE &&
+        (fe = new (std::nothrow) circular_queue_frontend_t())) {
+        fe->buf = (uint8_t *)malloc(ram_size);
+        fe->capacity = ram_size;
+        fe->stopped = xSemaphoreCreateBinary();
+        fe->running = 1;
+        cq->frontend = fe;
+
+        ret = fe->buf && fe->stopped &&
+            xTaskCreatePinnedToCore(_frontend_flush_task, "cq_flush", SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_STACK, cq,
+                SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_PRIORITY, &fe->flush_task, SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_CORE) == pdPASS;
+
+        if (!ret) _frontend_free(cq);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_enqueue_buffered(circular_queue_t *cq, const void *elem, const uint16_t elem_size) {
+    uint8_t ret = 0;
+    circular_queue_frontend_t *fe = (circular_queue_frontend_t *)cq->frontend;
+    uint16_t size = cq->elem_size? cq->elem_size : elem_size;
+
+    if (fe && elem && size && size != CIRCULAR_QUEUE_FRONTEND_PAD) {
+        uint32_t need = CIRCULAR_QUEUE_FRONTEND_HDR_SIZE + size;
+        uint32_t pos = _frontend_reserve(fe, need);
+
+        if (pos != CIRCULAR_QUEUE_FRONTEND_NO_ROOM) {
+            memcpy(&fe->buf[pos], &size, CIRCULAR_QUEUE_FRONTEND_HDR_SIZE);
+            memcpy(&fe->buf[pos + CIRCULAR_QUEUE_FRONTEND_HDR_SIZE], elem, size);
+            // publish the record, release pairs with the consumer's acquire of head
+            fe->head.store((pos + need) % fe->capacity, std::memory_order_release);
+            xTaskNotifyGive(fe->flush_task);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+uint8_t spiffs_circular_queue_staging_init(circular_queue_t *cq) {
+    uint8_t ret = 0;
+    circular_queue_staging_t *st = NULL;
+
+    // internal RAM stays accessible from ISRs while the flash cache is disabled
+    if (!cq->staging && (st = (circular_queue_staging_t *)heap_caps_malloc(sizeof(circular_queue_staging_t), 
+        MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT))) {
+        new (st) circular_queue_staging_t();
+        for (uint32_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS; i++) {
+            st->slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        cq->staging = st;
+        ret = 1;
+    }
+
+    return ret;
+}
+
+uint8_t IRAM_ATTR spiffs_circular_queue_enqueue_from_isr(circular_queue_t *cq, const void *elem, const uint16_t elem_size) {
+    uint8_t ret = 0;
+    circular_queue_staging_t *st = (circular_queue_staging_t *)cq->staging;
+    uint16_t size = cq->elem_size? cq->elem_size : elem_size;
+
+    if (st && elem && size && size <= SPIFFS_CIRCULAR_QUEUE_ISR_SLOT_SIZE) {
+        circular_queue_staging_slot_t *slot = NULL;
+        uint32_t pos = st->enqueue_pos.load(std::memory_order_relaxed);
+
+        // claim a slot. Retries only when another producer claimed it first
+        while (!slot) {
+            circular_queue_staging_slot_t *candidate = &st->slots[pos & (SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS - 1)];
+            int32_t diff = (int32_t)(candidate->seq.load(std::memory_order_acquire) - pos);
+
+            if (diff == 0) {
+                if (st->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot = candidate;
+                }
+            } else if (diff < 0) { // slot not yet flushed, all are taken
+                break;
+            } else {
+                pos = st->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        if (slot) {
+            memcpy(slot->data, elem, size);
+            slot->size = size;
+            // hand the slot over to the consumer
+            slot->seq.store(pos + 1, std::memory_order_release);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+uint8_t spiffs_circular_queue_enqueue_async(circular_queue_t *cq, const void *elem, const uint16_t elem_size, 
+                                            circular_queue_async_cb_t cb, void *ctx) {
+    circular_queue_async_op_t op = {CIRCULAR_QUEUE_ASYNC_ENQUEUE, cq, (void *)elem, elem_size, 0, cb, ctx};
+
+    return _async_submit(&op);
+}
+
+uint8_t spiffs_circular_queue_dequeue_async(circular_queue_t *cq, void *elem, circular_queue_async_cb_t cb, void *ctx) {
+    circular_queue_async_op_t op = {CIRCULAR_QUEUE_ASYNC_DEQUEUE, cq, elem, 0, 0, cb, ctx};
+
+    return _async_submit(&op);
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND || SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+uint8_t spiffs_circular_queue_flush(circular_queue_t *cq) {
+    return _buffered_drain(cq);
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+uint8_t spiffs_circular_queue_defer_persist(circular_queue_t *cq, const uint8_t enable) {
+    CIRCULAR_QUEUE_LOCK(cq->mutex);
+    cq->deferred = enable? 1 : 0;
+    CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+
+    return enable || spiffs_circular_queue_sync(cq);
+}
+
+uint8_t spiffs_circular_queue_sync(circular_queue_t *cq) {
+    uint8_t ret = 1;
+
+    if (cq->dirty) {
+        FILE *fd = NULL;
+
+        // the handle is taken before the state lock, as on enqueue and dequeue
+        if ((fd = _open_medium(cq, 0))) {
+            CIRCULAR_QUEUE_LOCK(cq->mutex);
+            if (cq->dirty) ret = _spiffs_circular_queue_persist(cq, fd);
+            CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+            _close_medium(cq, fd);
+        } else {
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_sync_all(void) {
+    uint8_t ret = 1;
+    circular_queue_t *queues[SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE] = {};
+
+    // registry snapshot, the sync takes pool handles under the registry lock
+    if (_registry_state == 2) {
+        CIRCULAR_QUEUE_LOCK(_registry_mutex);
+        memcpy(queues, _registry, sizeof(queues));
+        CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+    }
+
+    for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE; i++) {
+        if (queues[i] && !spiffs_circular_queue_sync(queues[i])) ret = 0;
+    }
+
+    return ret;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+uint8_t spiffs_circular_queue_enqueue_durable(circular_queue_t *cq, const void *elem, const uint16_t elem_size, 
+                                              const circular_queue_durability_t durability) {
+    uint8_t ret = 0;
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    if (durability == CIRCULAR_QUEUE_DURABILITY_NONE && cq->frontend) {
+        ret = spiffs_circular_queue_enqueue_buffered(cq, elem, elem_size);
+    } else {
+        // elems buffered before go to the file first
+        if (cq->frontend) _buffered_drain(cq);
+        circular_queue_iovec_t iov = _iov_single(cq, elem, elem_size);
+        ret = _enqueue_file(cq, &iov, 1, 
+            durability == CIRCULAR_QUEUE_DURABILITY_FULL? _spiffs_circular_queue_persist : _mark_dirty);
+    }
+#else
+    circular_queue_iovec_t iov = _iov_single(cq, elem, elem_size);
+    ret = _enqueue_file(cq, &iov, 1, 
+        durability == CIRCULAR_QUEUE_DURABILITY_FULL? _spiffs_circular_queue_persist : _mark_dirty);
+#endif
+
+    return ret;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+uint8_t spiffs_circular_queue_fault_arm(const uint32_t cut_after, const uint32_t torn_size, const uint16_t page_size) {
+    free(_fault.page_image);
+    _fault.page_image = page_size? (uint8_t *)malloc(page_size) : NULL;
+
+    uint8_t ret = _fault.page_image != NULL;
+
+    _fault.armed = ret;
+    _fault.cut = 0;
+    _fault.writes = 0;
+    _fault.cut_after = cut_after;
+    _fault.torn_size = torn_size;
+    _fault.page_size = page_size;
+    _fault.page_fd = NULL;
+
+    return ret;
+}
+
+uint32_t spiffs_circular_queue_fault_disarm(void) {
+    _fault.armed = 0;
+    _fault.cut = 0;
+    _fault.page_fd = NULL;
+    free(_fault.page_image);
+    _fault.page_image = NULL;
+
+    return _fault.writes;
+}
+#endif
+
+#define SPIFFS_CIRCULAR_QUEUE_PERSIST_SIZE  (sizeof(uint32_t)*2 + sizeof(uint16_t)) ///< Persist bytes
+// not null-pointer safe. Must be called with the state lock held
+static uint8_t _spiffs_circular_queue_persist(circular_queue_t *cq, FILE *fd) {
+    uint8_t nwritten = 0;
+
+    fseek(fd, 0, SEEK_SET);
+    // write front_idx and back indices to the file's head
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->front_idx), 1, sizeof(cq->front_idx), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->back_idx), 1, sizeof(cq->back_idx), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->count), 1, sizeof(cq->count), fd);
+
+    uint8_t ret = (nwritten == SPIFFS_CIRCULAR_QUEUE_PERSIST_SIZE);
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+    // cursors positions are relative to the front. With none registered the table on the flash is empty already
+    if (ret && cq->flags.fields.cursors && _cursors_in_use(cq)) ret = _cursors_write(cq, fd);
+#endif
+
+    // sync under the state lock, a late sync of a stale header from another handle would overwrite this one
+    ret = ret && _sync_medium(fd);
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    if (ret) {
+        cq->dirty = 0;
+        cq->freed = 0;
+    }
+#endif
+
+    return ret;
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+// not null-pointer safe. Must be called with the state lock held
+static uint8_t _mark_dirty(circular_queue_t *cq, FILE *fd) {
+    (void)fd; // same signature as _spiffs_circular_queue_persist
+    cq->dirty = 1;
+
+    return 1;
+}
+#endif
+
+// not null-pointer safe. Must be called with the state lock held
+static uint8_t _persist_or_defer(circular_queue_t *cq, FILE *fd) {
+    uint8_t ret = 0;
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    ret = cq->deferred? _mark_dirty(cq, fd) : _spiffs_circular_queue_persist(cq, fd);
+#else
+    ret = _spiffs_circular_queue_persist(cq, fd);
+#endif
+
+    return ret;
+}
+
+static inline circular_queue_iovec_t _iov_single(const circular_queue_t *cq, const void *elem, const uint16_t elem_size) {
+    circular_queue_iovec_t iov = {elem, cq->elem_size? cq->elem_size : elem_size};
+
+    return iov;
+}
+
+static uint8_t _enqueue_file(circular_queue_t *cq, const circular_queue_iovec_t *iov, const uint8_t iovcnt, 
+                             uint8_t (*persist)(circular_queue_t *, FILE *)) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(cq->enqueue_mutex);
+    FILE *fd = NULL;
+
+    if ((fd = _open_medium(cq, 0))) {
+        if (_enqueue_medium(cq, fd, iov, iovcnt)) {
+            CIRCULAR_QUEUE_LOCK(cq->mutex);
+            ret = persist(cq, fd);
+            CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+        }
+        _close_medium(cq, fd);
+    }
+    CIRCULAR_QUEUE_UNLOCK(cq->enqueue_mutex);
+
+    return ret;
+}
+
+static uint8_t _mount_spiffs(void) {
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = "/spiffs",
+        .partition_label = NULL,
+        .max_files = SPIFFS_MAX_FILES_COUNT,
+        .format_if_mount_failed = false
+    };
+    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+
+    return (ret == ESP_OK);
+}
+
+static uint8_t _unmount_spiffs(void) {
+    return (esp_vfs_spiffs_unregister(NULL) == ESP_OK);
+}
+
+// not null-pointer safe
+static uint8_t _enqueue_medium(circular_queue_t *cq, FILE *fd, const circular_queue_iovec_t *iov, const uint8_t iovcnt) {
+    uint32_t size = _enqueue_write(cq, fd, iov, iovcnt, 0);
+
+    return size && _enqueue_commit(cq, fd, size, 1);
+}
+
+// not null-pointer safe
+static uint32_t _enqueue_write(circular_queue_t *cq, FILE *fd, const circular_queue_iovec_t *iov, const uint8_t iovcnt, 
+                               const uint32_t pending) {
+    uint32_t ret = 0;
+    uint8_t valid = 1;
+    uint32_t enqueue_size = 0;
+
+    for (uint8_t i = 0; i < iovcnt; i++) {
+        enqueue_size += iov[i].len;
+        valid = valid && (iov[i].base || !iov[i].len);
+    }
+    // fixed elem size queues take whole elems only
+    valid = valid && enqueue_size <= UINT16_MAX && (!cq->elem_size || enqueue_size == cq->elem_size);
+
+    // data goes to the free region past back_idx, no consumer reads it until count grows
+    if (valid && _enqueue_admit(cq, fd, pending, enqueue_size) && 
+        _write_medium(cq, fd, (cq->back_idx + pending) % cq->max_size, iov, iovcnt, enqueue_size)
+    ) {
+        ret = enqueue_size + (cq->elem_size? 0 : sizeof(uint16_t));
+    }
+
+    return ret;
+}
+
+// not null-pointer safe
+static uint8_t _enqueue_admit(circular_queue_t *cq, FILE *fd, const uint32_t pending, const uint32_t enqueue_size) {
+    uint8_t ret = 0;
+
+#if !SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    (void)fd; // only persists the header ahead of deferred writes
+#endif
+
+    // producers are serialized, thus back_idx is owned by the caller until the enqueue lock is released.
+    //   available space can only grow meanwhile, as consumers just move front_idx forward.
+    if (enqueue_size && spiffs_circular_queue_available_space(cq) >= pending + enqueue_size &&
+        (!SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE ||
+        (SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE && enqueue_size < SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE))
+    ) {
+        ret = 1;
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+        // space freed since the last persist still holds elems of the header on the flash,
+        //   it is written over only once the header moves past them
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        if (cq->freed + pending + enqueue_size > _available_space(cq)) ret = _spiffs_circular_queue_persist(cq, fd);
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+        // until the first wrap the file grows with every elem, other files may have taken the space meanwhile
+        uint32_t end = _circular_queue_get_data_offset(cq) + cq->back_idx + pending + enqueue_size + 
+            (cq->elem_size? 0 : sizeof(uint16_t));
+        if (end > _spiffs_circular_queue_full_size(cq)) end = _spiffs_circular_queue_full_size(cq);
+        if (ret && end > cq->file_size) ret = _space_admit(end - cq->file_size);
+#endif
+    }
+
+    return ret;
+}
+
+// not null-pointer safe
+static uint8_t _enqueue_commit(circular_queue_t *cq, FILE *fd, const uint32_t size, const uint16_t count) {
+    uint8_t ret = 1;
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    // the data must reach the flash before count grows, consumers read through their own file handle
+    ret = _sync_medium(fd);
+#else
+    (void)fd; // single task, the header persist syncs data and header at once
+#endif
+
+    if (ret) {
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+        uint32_t end = _circular_queue_get_data_offset(cq) + cq->back_idx + size;
+        if (end > _spiffs_circular_queue_full_size(cq)) end = _spiffs_circular_queue_full_size(cq);
+        if (end > cq->file_size) cq->file_size = end;
+#endif
+
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        cq->back_idx = (cq->back_idx + size) % cq->max_size;
+        cq->count += count;
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+        _watermark_check(cq);
+#endif
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+        CIRCULAR_QUEUE_SIGNAL(cq, CIRCULAR_QUEUE_EVENT_DATA);
+    }
+
+    return ret;
+}
+
+// not null-pointer safe, except elem_size for fixed elem size queues
+static uint8_t _dequeue_medium(circular_queue_t *cq, FILE *fd, void *elem, uint16_t *elem_size) {
+    uint8_t ret = 0;
+
+    // consumers are serialized, thus front_idx is owned by the caller until the dequeue lock is released.
+    //   the front elem can't be overwritten meanwhile, as its space is not freed yet.
+    if (!spiffs_circular_queue_is_empty(cq) && _read_medium(cq, fd, cq->front_idx, elem, elem_size)) {
+        uint16_t dequeued_size = cq->elem_size? cq->elem_size : (sizeof(*elem_size) + *elem_size);
+
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        cq->front_idx = (cq->front_idx + dequeued_size) % cq->max_size;
+        cq->count--;
+        cq->dequeue_seq++;
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+        cq->freed += dequeued_size;
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+        // the elem is dropped for all cursors, the ones past it are one elem less ahead
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+            if (cq->cursors[i].name[0] && cq->cursors[i].ahead) cq->cursors[i].ahead--;
+        }
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+        _watermark_check(cq);
+#endif
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+        CIRCULAR_QUEUE_SIGNAL(cq, CIRCULAR_QUEUE_EVENT_SPACE);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+// not null-pointer safe
+static uint8_t _write_medium(const circular_queue_t *cq, FILE *fd, const uint32_t idx, const circular_queue_iovec_t *iov, 
+                             const uint8_t iovcnt, const uint16_t data_size) {
+    // spiffs medium
+    uint32_t nwritten = 0;
+    uint32_t ring_idx = idx;
+
+    fseek(fd, _circular_queue_get_data_offset(cq) + idx, SEEK_SET);
+
+    if (!cq->elem_size) { // if variable elem size, size prefix first
+        nwritten = _write_ring(cq, fd, &ring_idx, &data_size, sizeof(data_size));
+    }
+    // fragments follow each other, any of them may be split over the file end
+    for (uint8_t i = 0; i < iovcnt; i++) {
+        nwritten += _write_ring(cq, fd, &ring_idx, iov[i].base, iov[i].len);
+    }
+
+    return (nwritten == (cq->elem_size? cq->elem_size : (sizeof(data_size) + data_size)));
+}
+
+// not null-pointer safe
+static uint16_t _write_ring(const circular_queue_t *cq, FILE *fd, uint32_t *idx, const void *data, const uint16_t size) {
+    uint16_t nwritten = 0;
+    uint32_t tail = cq->max_size - *idx; // bytes up to the file end
+
+    if (size < tail) { // normal write
+        nwritten = size? CIRCULAR_QUEUE_FWRITE(data, 1, size, fd) : 0;
+    } else { // split write, the rest goes to the first usable byte
+        nwritten = CIRCULAR_QUEUE_FWRITE(data, 1, tail, fd);
+        fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
+        if (size > tail) {
+            nwritten += CIRCULAR_QUEUE_FWRITE(&((const uint8_t *)data)[tail], 1, size - tail, fd);
+        }
+    }
+    *idx = (*idx + size) % cq->max_size;
+
+    return nwritten;
+}
+
+// read only non-null-pointer data and data_size. null-poiner safe, except fd
+static uint8_t _read_medium(const circular_queue_t *cq, FILE *fd, const uint32_t front_idx, void *data, uint16_t *data_size) {
+    // spiffs medium
+    uint8_t ret = 1;
+
+    uint16_t nread = 0;
+
+    uint32_t next_front_idx = _circular_queue_get_data_offset(cq) + front_idx;
+    fseek(fd, next_front_idx, SEEK_SET);
+
+    if (!cq->elem_size) { // if fixed elem size
+        if (data_size) { // case 1: split elem size
+            if (next_front_idx + sizeof(*data_size) > _spiffs_circular_queue_full_size(cq)) {
+                uint8_t buf[sizeof(*data_size)];
+                // read first half
+                nread = fread(buf, 1, cq->max_size - front_idx, fd);
+                // set seek to the first usable byte
+                fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
+                // read the rest of size
+                nread += fread(&buf[cq->max_size - front_idx], 1, sizeof(*data_size) - (cq->max_size - front_idx), fd);
+                // transform read by bytes data_size into uint16_t
+                memcpy(data_size, buf, sizeof(*data_size));
+                next_front_idx = _circular_queue_get_data_offset(cq) + sizeof(*data_size) - (cq->max_size - front_idx);
+            } else { // normal read
+                nread = fread(data_size, 1, sizeof(*data_size), fd);
+                next_front_idx += sizeof(*data_size);
+            }
+        } else {
+            ret = 0;
+        }
+    }
+
+    if (data) {
+        uint16_t read_size = cq->elem_size? cq->elem_size : *data_size;
+
+        // case 2: split elem data
+        if (next_front_idx + read_size > _spiffs_circular_queue_full_size(cq)) {
+            uint8_t *data_bp = (uint8_t *)data; // byte-pointer
+
+            nread += fread(data_bp, 1, _spiffs_circular_queue_full_size(cq) - next_front_idx, fd);
+            // set seek to the first usable byte
+            fseek(fd, _circular_queue_get_data_offset(cq), SEEK_SET);
+            // read the rest of data
+            nread += fread(&data_bp[_spiffs_circular_queue_full_size(cq) - next_front_idx], 1, 
+                read_size - (_spiffs_circular_queue_full_size(cq) - next_front_idx), fd);
+        } else { // normal read
+            nread += fread(data, 1, read_size, fd);
+        }
+    } else {
+        ret = 0;
+    }
+
+    if (ret) { // pointer validity checked
+        // check read bytes size
+        uint16_t exp_read_size = cq->elem_size? cq->elem_size : (sizeof(*data_size) + *data_size);
+        ret = nread == exp_read_size;
+    }
+
+    return ret;
+}
+
+static FILE *_pool_open(const void *owner, const char *fn, const uint8_t create) {
+    FILE *fd = NULL;
+
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+    circular_queue_fd_entry_t *entry = NULL;
+
+    // a new file, handles left from a former one are stale
+    if (create) _pool_evict(owner);
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    // an operation holds one handle at most, so a handle not in use always comes
+    xSemaphoreTake(_fd_pool_slots, portMAX_DELAY);
+#endif
+    CIRCULAR_QUEUE_LOCK(_registry_mutex);
+    // hot queue, reuse its idle handle unless the struct was re-pointed to another file since
+    for (uint8_t i = 0; !create && !entry && i < SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE; i++) {
+        if (_fd_pool[i].owner == owner && !_fd_pool[i].in_use && !strcmp(_fd_pool[i].fn, fn)) entry = &_fd_pool[i];
+    }
+
+    if (!entry) {
+        // a free entry, otherwise evict the least recently used idle handle
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE; i++) {
+            circular_queue_fd_entry_t *e = &_fd_pool[i];
+
+            if (!e->in_use && (!entry || (entry->fd && (!e->fd || e->last_used < entry->last_used)))) {
+                entry = e;
+            }
+        }
+
+        if (entry) {
+            if (entry->fd) fclose(entry->fd);
+            entry->fd = fopen(fn, create? "w+b" : "r+b");
+            entry->owner = entry->fd? owner : NULL;
+            strncpy(entry->fn, fn, SPIFFS_FILE_NAME_MAX_SIZE - 1);
+            entry->fn[SPIFFS_FILE_NAME_MAX_SIZE - 1] = '\0';
+        }
+    }
+
+    if (entry && (fd = entry->fd)) {
+        entry->in_use = 1;
+    }
+    CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    if (!fd) xSemaphoreGive(_fd_pool_slots);
+#endif
+#else
+    (void)owner; // handles are not kept
+    fd = fopen(fn, create? "w+b" : "r+b");
+#endif
+
+    return fd;
+}
+
+static inline FILE *_open_medium(const circular_queue_t *cq, const uint8_t create) {
+    return _pool_open(cq, cq->fn, create);
+}
+
+static void _close_medium(circular_queue_t *cq, FILE *fd) {
+    _pool_close(fd);
+
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+    // the callback may use other queues, it must not hold a pool handle meanwhile
+    _watermark_fire(cq);
+#else
+    (void)cq;
+#endif
+}
+
+static void _pool_close(FILE *fd) {
+    // what fclose did, but the handle stays open for the next operation.
+    //   fflush also drops read-ahead, so the next one reads what other handles wrote
+    _sync_medium(fd);
+
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+    CIRCULAR_QUEUE_LOCK(_registry_mutex);
+    for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE; i++) {
+        if (_fd_pool[i].fd == fd) {
+            _fd_pool[i].in_use = 0;
+            _fd_pool[i].last_used = ++_fd_pool_clock;
+        }
+    }
+    CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    xSemaphoreGive(_fd_pool_slots);
+#endif
+#else
+    fclose(fd);
+#endif
+}
+
+static uint8_t _sync_medium(FILE *fd) {
+    // stdio buffer to the file system, then file system cache to the flash
+    uint8_t ret = !fflush(fd) && !fsync(fileno(fd));
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+    ret = ret && !_fault.cut;
+    // a synced page is programmed
+    if (ret && fd == _fault.page_fd) _fault.page_fd = NULL;
+#endif
+
+    return ret;
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI || SPIFFS_CIRCULAR_QUEUE_PRIO
+static uint8_t _fill_medium(FILE *fd, const uint32_t size) {
+    uint8_t ret = 1;
+    uint8_t zeros[64] = {0};
+
+    for (uint32_t nwritten = 0; ret && nwritten < size; nwritten += sizeof(zeros)) {
+        uint32_t chunk = size - nwritten < sizeof(zeros)? size - nwritten : sizeof(zeros);
+        ret = CIRCULAR_QUEUE_FWRITE(zeros, 1, chunk, fd) == chunk;
+    }
+
+    return ret;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+static size_t _fault_fwrite(const void *data, const size_t size, const size_t count, FILE *fd) {
+    size_t ret = 0;
+
+    if (!_fault.armed) {
+        ret = fwrite(data, size, count, fd);
+    } else if (!_fault.cut) {
+        size_t len = size*count;
+        long pos = ftell(fd);
+
+        if (++_fault.writes >= _fault.cut_after) {
+            len = len < _fault.torn_size? len : _fault.torn_size;
+            _fault.cut = 1;
+        }
+
+        if (len && pos >= 0) {
+            _fault_page_keep(fd, (pos + len - 1)/_fault.page_size);
+            ret = fwrite(data, 1, len, fd) == size*count? count : 0;
+        }
+
+        // the page not programmed loses all it got since, the restored image is what the flash holds
+        if (_fault.cut && _fault.page_fd && !fseek(_fault.page_fd, _fault.page*_fault.page_size, SEEK_SET)) {
+            fwrite(_fault.page_image, 1, _fault.page_len, _fault.page_fd);
+            fflush(_fault.page_fd);
+        }
+    }
+
+    return ret;
+}
+
+static void _fault_page_keep(FILE *fd, const uint32_t page) {
+    // moving on to another page programs the previous one
+    if (fd != _fault.page_fd || page != _fault.page) {
+        long pos = ftell(fd);
+
+        _fault.page_fd = fd;
+        _fault.page = page;
+        _fault.page_len = !fseek(fd, page*_fault.page_size, SEEK_SET)? fread(_fault.page_image, 1, _fault.page_size, fd) : 0;
+        fseek(fd, pos, SEEK_SET);
+    }
+}
+#endif
+
+static void _pool_evict(const void *owner) {
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+    if (_registry_state == 2) {
+        CIRCULAR_QUEUE_LOCK(_registry_mutex);
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE; i++) {
+            circular_queue_fd_entry_t *e = &_fd_pool[i];
+
+            if (e->fd && !e->in_use && (!owner || e->owner == owner)) {
+                fclose(e->fd);
+                e->fd = NULL;
+                e->owner = NULL;
+            }
+        }
+        CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+    }
+#else
+    (void)owner; // no handle outlives its operation
+#endif
+}
+
+#if CIRCULAR_QUEUE_REGISTRY
+static uint8_t _registry_add(circular_queue_t *cq) {
+    uint8_t ret = 0;
+    circular_queue_t **slot = NULL;
+
+    CIRCULAR_QUEUE_LOCK(_registry_mutex);
+    for (uint8_t i = 0; !ret && i < SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE; i++) {
+        if (_registry[i] == cq) { // re-initialization
+            ret = 1;
+        } else if (!_registry[i] && !slot) {
+            slot = &_registry[i];
+        }
+    }
+
+    if (!ret && slot) {
+        *slot = cq;
+        ret = 1;
+    }
+    CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+
+    return ret;
+}
+
+static void _registry_remove(const circular_queue_t *cq) {
+    if (_registry_state == 2) {
+        CIRCULAR_QUEUE_LOCK(_registry_mutex);
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE; i++) {
+            if (_registry[i] == cq) _registry[i] = NULL;
+        }
+        CIRCULAR_QUEUE_UNLOCK(_registry_mutex);
+    }
+}
+#endif
+
+static uint8_t _registry_start(void) {
+    uint8_t ret = 1;
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    _registry_mutex = xSemaphoreCreateMutex();
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+    _fd_pool_slots = xSemaphoreCreateCounting(SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE, SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE);
+
+    ret = _registry_mutex && _fd_pool_slots;
+    if (!ret) {
+        if (_registry_mutex) vSemaphoreDelete(_registry_mutex);
+        if (_fd_pool_slots) vSemaphoreDelete(_fd_pool_slots);
+        _registry_mutex = _fd_pool_slots = NULL;
+    }
+#else
+    ret = _registry_mutex != NULL;
+#endif
+#endif
+
+    return ret;
+}
+
+static uint8_t _call_once(std::atomic<uint8_t> *state, uint8_t (*start_func)(void)) {
+    uint8_t expected = 0;
+
+    if (state->compare_exchange_strong(expected, 1)) {
+        *state = start_func()? 2 : 0;
+    } else {
+        while (*state == 1) vTaskDelay(1);
+    }
+
+    return *state == 2;
+}
+
+// not thread safe, state lock must be held
+static uint32_t _size(const circular_queue_t *cq) {
+    uint32_t qsize = 0;
+
+    uint32_t elem_size_total = cq->elem_size? 0 : cq->count*sizeof(uint16_t);
+
+    if (cq->back_idx > cq->front_idx) {
+        qsize = cq->back_idx - cq->front_idx - elem_size_total;
+    } else if (cq->back_idx < cq->front_idx) {
+        qsize = cq->max_size - cq->front_idx + cq->back_idx - elem_size_total;
+    } else if (cq->count) { // && indices are equal
+        qsize = cq->max_size - elem_size_total;
+    }
+
+    return qsize;
+}
+
+// not thread safe, state lock must be held
+static uint32_t _available_space(const circular_queue_t *cq) {
+    uint32_t elem_size_total = 0;
+    uint16_t next_elem_size = 0;
+
+    if (!cq->elem_size) { // if variable elem size
+        elem_size_total = cq->count*sizeof(uint16_t);
+        next_elem_size = sizeof(uint16_t);
+    }
+
+    uint32_t gross_available_space = cq->max_size - 
+                                (_size(cq) + elem_size_total);
+
+    return gross_available_space <= next_elem_size ? 0 : gross_available_space - next_elem_size;
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+// records never wrap, a record that doesn't fit before the ring end is placed at 0 
+//   and the skipped tail is marked with a pad record when there is room for its header
+static uint32_t _frontend_reserve(circular_queue_frontend_t *fe, const uint32_t need) {
+    uint32_t pos = CIRCULAR_QUEUE_FRONTEND_NO_ROOM;
+    uint32_t head = fe->head.load(std::memory_order_relaxed);
+    uint32_t tail = fe->tail.load(std::memory_order_acquire);
+
+    if (head >= tail) {
+        // head must not reach tail, otherwise the ring would look empty
+        if (need + (tail == 0) <= fe->capacity - head) {
+            pos = head;
+        } else if (need < tail) {
+            if (fe->capacity - head >= CIRCULAR_QUEUE_FRONTEND_HDR_SIZE) {
+                uint16_t pad = CIRCULAR_QUEUE_FRONTEND_PAD;
+                memcpy(&fe->buf[head], &pad, CIRCULAR_QUEUE_FRONTEND_HDR_SIZE);
+            }
+            pos = 0;
+        }
+    } else if (need < tail - head) {
+        pos = head;
+    }
+
+    return pos;
+}
+
+static uint8_t _frontend_peek(circular_queue_frontend_t *fe, uint32_t *pos, uint16_t *size) {
+    uint8_t ret = 0;
+    uint32_t tail = fe->tail.load(std::memory_order_relaxed);
+    uint32_t head = fe->head.load(std::memory_order_acquire);
+
+    if (tail != head) {
+        // skip the ring tail left before a wrap
+        if (fe->capacity - tail < CIRCULAR_QUEUE_FRONTEND_HDR_SIZE) {
+            tail = 0;
+        } else {
+            memcpy(size, &fe->buf[tail], CIRCULAR_QUEUE_FRONTEND_HDR_SIZE);
+            if (*size == CIRCULAR_QUEUE_FRONTEND_PAD) tail = 0;
+        }
+        memcpy(size, &fe->buf[tail], CIRCULAR_QUEUE_FRONTEND_HDR_SIZE);
+        *pos = tail;
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static void _frontend_flush_task(void *arg) {
+    circular_queue_t *cq = (circular_queue_t *)arg;
+    circular_queue_frontend_t *fe = (circular_queue_frontend_t *)cq->frontend;
+
+    while (fe->running) {
+        // woken up by producers, periodically retries elems that didn't fit
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SPIFFS_CIRCULAR_QUEUE_FLUSH_PERIOD_MS));
+        if (fe->running) _buffered_drain(cq);
+    }
+
+    xSemaphoreGive(fe->stopped);
+    vTaskDelete(NULL);
+}
+
+static void _frontend_free(circular_queue_t *cq) {
+    circular_queue_frontend_t *fe = (circular_queue_frontend_t *)cq->frontend;
+
+    if (fe) {
+        if (fe->flush_task) {
+            fe->running = 0;
+            xTaskNotifyGive(fe->flush_task);
+            xSemaphoreTake(fe->stopped, portMAX_DELAY);
+        }
+        if (fe->stopped) vSemaphoreDelete(fe->stopped);
+        free(fe->buf);
+        delete fe;
+        cq->frontend = NULL;
+    }
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+static uint8_t _async_start(void) {
+    uint8_t ret = 0;
+
+    _async_ops = xQueueCreate(SPIFFS_CIRCULAR_QUEUE_ASYNC_QUEUE_LEN, sizeof(circular_queue_async_op_t));
+
+    if (_async_ops && xTaskCreatePinnedToCore(_async_io_task, "cq_io", SPIFFS_CIRCULAR_QUEUE_IO_TASK_STACK, NULL,
+        SPIFFS_CIRCULAR_QUEUE_IO_TASK_PRIORITY, NULL, SPIFFS_CIRCULAR_QUEUE_IO_TASK_CORE) == pdPASS) {
+        ret = 1;
+    } else if (_async_ops) {
+        vQueueDelete(_async_ops);
+        _async_ops = NULL;
+    }
+
+    return ret;
+}
+
+static uint8_t _async_submit(const circular_queue_async_op_t *op) {
+    uint8_t ret = 0;
+
+    if ((op->elem || op->type == CIRCULAR_QUEUE_ASYNC_ENQUEUE) && _call_once(&_async_state, _async_start)) {
+        ret = xQueueSend(_async_ops, op, 0) == pdTRUE;
+    }
+
+    return ret;
+}
+
+static void _async_io_task(void *arg) {
+    circular_queue_async_op_t batch[SPIFFS_CIRCULAR_QUEUE_ASYNC_BATCH_SIZE];
+
+    (void)arg; // operations come through _async_ops
+
+    for (;;) {
+        uint16_t n = 0;
+
+        xQueueReceive(_async_ops, &batch[n++], portMAX_DELAY);
+        // merge following operations of the same type on the same queue
+        while (n < SPIFFS_CIRCULAR_QUEUE_ASYNC_BATCH_SIZE && xQueuePeek(_async_ops, &batch[n], 0) == pdTRUE &&
+            batch[n].type == batch[0].type && batch[n].cq == batch[0].cq) {
+            xQueueReceive(_async_ops, &batch[n++], 0);
+        }
+
+        circular_queue_t *cq = batch[0].cq;
+        uint8_t is_enqueue = batch[0].type == CIRCULAR_QUEUE_ASYNC_ENQUEUE;
+        SemaphoreHandle_t side_mutex = is_enqueue? cq->enqueue_mutex : cq->dequeue_mutex;
+        FILE *fd = NULL;
+        uint8_t persisted = 0;
+
+        CIRCULAR_QUEUE_LOCK(side_mutex);
+        if ((fd = _open_medium(cq, 0))) {
+            uint8_t moved = 0;
+            uint16_t written = 0;
+            uint32_t pending = 0;
+
+            for (uint16_t i = 0; i < n; i++) {
+                circular_queue_iovec_t iov = _iov_single(cq, batch[i].elem, batch[i].elem_size);
+                uint32_t size = 0;
+
+                if (is_enqueue) {
+                    // enqueued elems are only written here, the batch is committed after a single data sync
+                    size = _enqueue_write(cq, fd, &iov, 1, pending);
+                    pending += size;
+                    written += size > 0;
+                    batch[i].result = size > 0;
+                } else {
+                    batch[i].result = _dequeue_medium(cq, fd, batch[i].elem, &batch[i].elem_size);
+                }
+                moved |= batch[i].result;
+            }
+            if (written && !_enqueue_commit(cq, fd, pending, written)) {
+                moved = 0;
+            }
+
+            // one persist for the whole batch
+            if (moved) {
+                CIRCULAR_QUEUE_LOCK(cq->mutex);
+                persisted = _persist_or_defer(cq, fd);
+                CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+            }
+            _close_medium(cq, fd);
+        }
+        CIRCULAR_QUEUE_UNLOCK(side_mutex);
+
+        for (uint16_t i = 0; i < n; i++) {
+            if (cq->elem_size) batch[i].elem_size = cq->elem_size;
+            if (batch[i].cb) batch[i].cb(cq, batch[i].result && persisted, batch[i].elem_size, batch[i].ctx);
+        }
+    }
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND || SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+static uint8_t _buffered_peek(const circular_queue_t *cq, const uint8_t **elem, uint16_t *size, circular_queue_buffered_t *origin) {
+    uint8_t ret = 0;
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+    circular_queue_staging_t *st = (circular_queue_staging_t *)cq->staging;
+
+    if (st) {
+        circular_queue_staging_slot_t *slot = &st->slots[st->dequeue_pos & (SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS - 1)];
+
+        // a claimed slot still being written by its producer is left for the next flush
+        if (slot->seq.load(std::memory_order_acquire) == st->dequeue_pos + 1) {
+            *elem = slot->data;
+            *size = slot->size;
+            *origin = CIRCULAR_QUEUE_BUFFERED_STAGING;
+            ret = 1;
+        }
+    }
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    circular_queue_frontend_t *fe = (circular_queue_frontend_t *)cq->frontend;
+    uint32_t pos = 0;
+
+    if (!ret && fe && _frontend_peek(fe, &pos, size)) {
+        *elem = &fe->buf[pos + CIRCULAR_QUEUE_FRONTEND_HDR_SIZE];
+        *origin = CIRCULAR_QUEUE_BUFFERED_FRONTEND;
+        ret = 1;
+    }
+#endif
+
+    return ret;
+}
+
+static void _buffered_release(circular_queue_t *cq, const circular_queue_buffered_t origin) {
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+    if (origin == CIRCULAR_QUEUE_BUFFERED_STAGING) {
+        circular_queue_staging_t *st = (circular_queue_staging_t *)cq->staging;
+        circular_queue_staging_slot_t *slot = &st->slots[st->dequeue_pos & (SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS - 1)];
+
+        // free the slot for the producer coming a lap later
+        slot->seq.store(st->dequeue_pos + SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS, std::memory_order_release);
+        st->dequeue_pos++;
+    }
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    if (origin == CIRCULAR_QUEUE_BUFFERED_FRONTEND) {
+        circular_queue_frontend_t *fe = (circular_queue_frontend_t *)cq->frontend;
+        uint32_t pos = 0;
+        uint16_t size = 0;
+
+        _frontend_peek(fe, &pos, &size);
+        fe->tail.store((pos + CIRCULAR_QUEUE_FRONTEND_HDR_SIZE + size) % fe->capacity, std::memory_order_release);
+    }
+#endif
+}
+
+static uint8_t _buffered_drain(circular_queue_t *cq) {
+    uint8_t ret = 1;
+    const uint8_t *elem = NULL;
+    uint16_t size = 0;
+    circular_queue_buffered_t origin;
+
+    // the drain is the RAM consumer and a queue producer at the same time
+    CIRCULAR_QUEUE_LOCK(cq->enqueue_mutex);
+    while (ret && _buffered_peek(cq, &elem, &size, &origin)) {
+        FILE *fd = NULL;
+        uint16_t moved = 0;
+
+        if ((fd = _open_medium(cq, 0))) {
+            // one file open, one data sync and one persist per batch
+            uint8_t moving = 1;
+            uint32_t pending = 0;
+            while (moving && moved < SPIFFS_CIRCULAR_QUEUE_FLUSH_BATCH_SIZE && _buffered_peek(cq, &elem, &size, &origin)) {
+                circular_queue_iovec_t iov = {elem, size};
+                uint32_t written = _enqueue_write(cq, fd, &iov, 1, pending);
+
+                // the RAM copy is released once written, a failed sync drops the batch
+                if ((moving = written > 0)) {
+                    _buffered_release(cq, origin);
+                    pending += written;
+                    moved++;
+                }
+            }
+
+            if (moved) {
+                ret = _enqueue_commit(cq, fd, pending, moved);
+                CIRCULAR_QUEUE_LOCK(cq->mutex);
+                ret = ret && _persist_or_defer(cq, fd);
+                CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+            }
+            _close_medium(cq, fd);
+        }
+        // full queue or medium failure, the rest stays buffered
+        ret = ret && moved;
+    }
+    CIRCULAR_QUEUE_UNLOCK(cq->enqueue_mutex);
+
+    return ret;
+}
+#endif
+
+static inline uint32_t _spiffs_circular_queue_full_size(const circular_queue_t *cq) {
+    return (cq->max_size + _circular_queue_get_data_offset(cq));
+}
+
+static inline uint8_t _circular_queue_get_data_offset(const circular_queue_t *cq) {
+    uint8_t ret = CIRCULAR_QUEUE_DATA_OFFSET_FIXED;
+
+    if (cq->flags.fields.fixed_elem_size) {
+        ret += sizeof(uint16_t);
+    }
+
+    if (cq->flags.fields.cursors) {
+        ret += CIRCULAR_QUEUE_CURSORS_TABLE_SIZE;
+    }
+
+    return ret;
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+static uint8_t _recovery_scan(circular_queue_t *cq, FILE *fd) {
+    uint8_t ret = cq->max_size > 0;
+    struct stat sb;
+    circular_queue_scan_cache_t cache;
+    uint32_t used = 0;          // data bytes between front and back indices, as the header says
+    uint32_t present = 0;       // data bytes the file really holds
+    uint32_t pos = 0;           // front relative index of the next elem
+    uint16_t count = 0;         // consistent elems
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    uint32_t last_pos = 0;      // front relative index of the last consistent elem
+#endif
+
+    cache.start = cache.len = 0;
+
+    if (ret && (cq->front_idx >= cq->max_size || cq->back_idx >= cq->max_size)) {
+        // header is garbage, nothing to walk
+        cq->front_idx = 0;
+    } else if (ret && cq->count) {
+        used = cq->back_idx > cq->front_idx? cq->back_idx - cq->front_idx : cq->max_size - cq->front_idx + cq->back_idx;
+    }
+
+    if (!fstat(fileno(fd), &sb) && (uint32_t)sb.st_size > _circular_queue_get_data_offset(cq)) {
+        present = sb.st_size - _circular_queue_get_data_offset(cq);
+    }
+
+    while (count < cq->count && pos < used) {
+        uint32_t elem_idx = (cq->front_idx + pos) % cq->max_size;
+        uint32_t total = cq->elem_size;
+
+        if (!cq->elem_size) { // variable elem size, read its size prefix
+            uint8_t buf[sizeof(uint16_t)];
+            uint16_t size = 0;
+
+            if (!_scan_byte(cq, fd, &cache, elem_idx, &buf[0]) || 
+                !_scan_byte(cq, fd, &cache, (elem_idx + 1) % cq->max_size, &buf[1])) {
+                break;
+            }
+            memcpy(&size, buf, sizeof(size));
+            if (!size) break;
+#if SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE
+            if (size >= SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE) break;
+#endif
+            total = sizeof(size) + size;
+        }
+
+        // the elem must end before back index and lay on bytes the file has
+        uint32_t last_idx = elem_idx + total - 1;
+        if (pos + total > used || (last_idx < cq->max_size? last_idx : cq->max_size - 1) >= present) break;
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+        last_pos = pos;
+#endif
+        pos += total;
+        count++;
+    }
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    // blocks are skipped whole by their size prefix, a torn write can only leave the last one broken
+    if (cq->flags.fields.blocks && count && 
+        !_scan_block_crc(cq, fd, &cache, (cq->front_idx + last_pos) % cq->max_size, pos - last_pos)) {
+        pos = last_pos;
+        count--;
+    }
+#endif
+
+    cq->recovered = 0;
+    if (ret && (count != cq->count || cq->back_idx != (cq->front_idx + pos) % cq->max_size)) {
+        cq->recovered = cq->count > count? cq->count - count : 0;
+        cq->back_idx = (cq->front_idx + pos) % cq->max_size;
+        cq->count = count;
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+        // cursors past the cut are left at the back
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+            if (cq->cursors[i].name[0] && cq->cursors[i].ahead >= count) {
+                cq->cursors[i].ahead = count;
+                cq->cursors[i].front_idx = cq->back_idx;
+            }
+        }
+#endif
+        ret = _spiffs_circular_queue_persist(cq, fd);
+    }
+
+    return ret;
+}
+
+static uint8_t _scan_byte(const circular_queue_t *cq, FILE *fd, circular_queue_scan_cache_t *cache, 
+                          const uint32_t idx, uint8_t *byte) {
+    if (idx < cache->start || idx >= cache->start + cache->len) {
+        uint32_t len = cq->max_size - idx < sizeof(cache->buf)? cq->max_size - idx : sizeof(cache->buf);
+
+        cache->start = idx;
+        cache->len = fseek(fd, _circular_queue_get_data_offset(cq) + idx, SEEK_SET)? 0 : fread(cache->buf, 1, len, fd);
+    }
+
+    if (cache->len) *byte = cache->buf[idx - cache->start];
+
+    return cache->len > 0;
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+uint8_t spiffs_circular_queue_cursor_open(circular_queue_t *cq, const char *name, uint8_t *cursor_id) {
+    uint8_t ret = 0;
+
+    if (cq->flags.fields.cursors && name && name[0] && strlen(name) < SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE && cursor_id) {
+        CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
+        uint8_t found = SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS;
+        uint8_t free_entry = SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS;
+
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+            if (!cq->cursors[i].name[0]) {
+                if (free_entry == SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS) free_entry = i;
+            } else if (!strncmp(cq->cursors[i].name, name, SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE)) {
+                found = i;
+            }
+        }
+
+        if (found < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS) {
+            *cursor_id = found;
+            ret = 1;
+        } else if (free_entry < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS) {
+            circular_queue_cursor_t *cursor = &cq->cursors[free_entry];
+            FILE *fd = NULL;
+
+            if ((fd = _open_medium(cq, 0))) {
+                CIRCULAR_QUEUE_LOCK(cq->mutex);
+                // starts with the slowest ones, at the front
+                strncpy(cursor->name, name, SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE);
+                cursor->front_idx = 0;
+                cursor->ahead = 0;
+                if (!(ret = _spiffs_circular_queue_persist(cq, fd))) {
+                    memset(cursor, 0x0, sizeof(circular_queue_cursor_t));
+                }
+                CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+                _close_medium(cq, fd);
+            }
+
+            if (ret) *cursor_id = free_entry;
+        }
+        CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_cursor_close(circular_queue_t *cq, const uint8_t cursor_id) {
+    uint8_t ret = 0;
+
+    if (cursor_id < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS && cq->cursors[cursor_id].name[0]) {
+        CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
+        FILE *fd = NULL;
+
+        if ((fd = _open_medium(cq, 0))) {
+            CIRCULAR_QUEUE_LOCK(cq->mutex);
+            memset(&cq->cursors[cursor_id], 0x0, sizeof(circular_queue_cursor_t));
+            _cursors_reclaim(cq);
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+            _watermark_check(cq);
+#endif
+            // the persist skips the table once the last cursor is gone
+            ret = _cursors_write(cq, fd) && _spiffs_circular_queue_persist(cq, fd);
+            CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+            _close_medium(cq, fd);
+        }
+        CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_dequeue_for(circular_queue_t *cq, const uint8_t cursor_id, void *elem, uint16_t *elem_size) {
+    uint8_t ret = 0;
+
+    if (cursor_id < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS && cq->cursors[cursor_id].name[0]) {
+        // consumers are serialized, the front and cursors positions are owned by the caller
+        CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
+        circular_queue_cursor_t *cursor = &cq->cursors[cursor_id];
+        FILE *fd = NULL;
+
+        if (spiffs_circular_queue_get_count(cq) > cursor->ahead && (fd = _open_medium(cq, 0))) {
+            uint32_t idx = cursor->ahead? cursor->front_idx : cq->front_idx;
+
+            if (_read_medium(cq, fd, idx, elem, elem_size)) {
+                uint16_t read_size = cq->elem_size? cq->elem_size : (sizeof(*elem_size) + *elem_size);
+
+                CIRCULAR_QUEUE_LOCK(cq->mutex);
+                cursor->front_idx = (idx + read_size) % cq->max_size;
+                cursor->ahead++;
+                _cursors_reclaim(cq);
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+                _watermark_check(cq);
+#endif
+                ret = _persist_or_defer(cq, fd);
+                CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+            }
+            _close_medium(cq, fd);
+        }
+        CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
+    }
+
+    return ret;
+}
+
+uint16_t spiffs_circular_queue_get_count_for(const circular_queue_t *cq, const uint8_t cursor_id) {
+    uint16_t ret = 0;
+
+    if (cursor_id < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS && cq->cursors[cursor_id].name[0]) {
+        CIRCULAR_QUEUE_LOCK(cq->mutex);
+        ret = cq->count - cq->cursors[cursor_id].ahead;
+        CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+    }
+
+    return ret;
+}
+
+static uint8_t _cursors_write(const circular_queue_t *cq, FILE *fd) {
+    uint16_t nwritten = 0;
+
+    fseek(fd, _circular_queue_get_data_offset(cq) - CIRCULAR_QUEUE_CURSORS_TABLE_SIZE, SEEK_SET);
+    for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+        nwritten += CIRCULAR_QUEUE_FWRITE(cq->cursors[i].name, 1, sizeof(cq->cursors[i].name), fd);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->cursors[i].front_idx), 1, sizeof(cq->cursors[i].front_idx), fd);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(cq->cursors[i].ahead), 1, sizeof(cq->cursors[i].ahead), fd);
+    }
+
+    return nwritten == CIRCULAR_QUEUE_CURSORS_TABLE_SIZE;
+}
+
+static uint8_t _cursors_read(circular_queue_t *cq, FILE *fd) {
+    uint16_t nread = 0;
+
+    fseek(fd, _circular_queue_get_data_offset(cq) - CIRCULAR_QUEUE_CURSORS_TABLE_SIZE, SEEK_SET);
+    for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+        nread += fread(cq->cursors[i].name, 1, sizeof(cq->cursors[i].name), fd);
+        nread += fread(&(cq->cursors[i].front_idx), 1, sizeof(cq->cursors[i].front_idx), fd);
+        nread += fread(&(cq->cursors[i].ahead), 1, sizeof(cq->cursors[i].ahead), fd);
+        cq->cursors[i].name[SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE - 1] = '\0';
+    }
+
+    return nread == CIRCULAR_QUEUE_CURSORS_TABLE_SIZE;
+}
+
+static uint8_t _cursors_in_use(const circular_queue_t *cq) {
+    uint8_t ret = 0;
+
+    for (uint8_t i = 0; !ret && i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+        ret = cq->cursors[i].name[0] != '\0';
+    }
+
+    return ret;
+}
+
+static void _cursors_reclaim(circular_queue_t *cq) {
+    circular_queue_cursor_t *slowest = NULL;
+
+    for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+        if (cq->cursors[i].name[0] && (!slowest || cq->cursors[i].ahead < slowest->ahead)) {
+            slowest = &cq->cursors[i];
+        }
+    }
+
+    // elems all cursors have read are freed
+    if (slowest && slowest->ahead) {
+        uint16_t reclaimed = slowest->ahead;
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+        // the front moves a whole lap when all elems of a full queue are reclaimed
+        uint32_t freed = (slowest->front_idx + cq->max_size - cq->front_idx) % cq->max_size;
+        cq->freed += (!freed && reclaimed == cq->count)? cq->max_size : freed;
+#endif
+        cq->front_idx = slowest->front_idx;
+        cq->count -= reclaimed;
+        cq->dequeue_seq++;
+        for (uint8_t i = 0; i < SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS; i++) {
+            if (cq->cursors[i].name[0]) cq->cursors[i].ahead -= reclaimed;
+        }
+        CIRCULAR_QUEUE_SIGNAL(cq, CIRCULAR_QUEUE_EVENT_SPACE);
+    }
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+uint8_t spiffs_circular_queue_block_enqueue(circular_queue_t *cq, const void *elem, const uint16_t elem_size) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(cq->enqueue_mutex);
+    circular_queue_block_buffer_t *blk = (circular_queue_block_buffer_t *)cq->block;
+    uint32_t entry_size = sizeof(elem_size) + elem_size;
+
+    if (blk && elem && elem_size && CIRCULAR_QUEUE_BLOCK_HDR_SIZE + entry_size <= blk->size) {
+        // a full block is written before the elem opens the next one
+        if (blk->len + entry_size > blk->size) {
+            _block_write(cq, blk);
+        }
+        if (blk->len + entry_size <= blk->size) {
+            memcpy(&blk->data[blk->len], &elem_size, sizeof(elem_size));
+            memcpy(&blk->data[blk->len + sizeof(elem_size)], elem, elem_size);
+            blk->len += entry_size;
+            blk->count++;
+            ret = 1;
+        }
+    }
+    CIRCULAR_QUEUE_UNLOCK(cq->enqueue_mutex);
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_block_flush(circular_queue_t *cq) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(cq->enqueue_mutex);
+    circular_queue_block_buffer_t *blk = (circular_queue_block_buffer_t *)cq->block;
+
+    if (blk) {
+        ret = !blk->count || _block_write(cq, blk);
+    }
+    CIRCULAR_QUEUE_UNLOCK(cq->enqueue_mutex);
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_block_dequeue(circular_queue_t *cq, void *buf, const uint16_t buf_size, 
+                                            circular_queue_block_t *block) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(cq->dequeue_mutex);
+    FILE *fd = NULL;
+
+    if (buf && block && cq->flags.fields.blocks && !spiffs_circular_queue_is_empty(cq) && (fd = _open_medium(cq, 0))) {
+        uint16_t len = 0;
+
+        // one read for the whole block past its size prefix
+        if (_read_ring(cq, fd, cq->front_idx, &len, sizeof(len)) == sizeof(len) && 
+            len >= CIRCULAR_QUEUE_BLOCK_HDR_SIZE && len <= buf_size &&
+            _read_ring(cq, fd, (cq->front_idx + sizeof(len)) % cq->max_size, buf, len) == len
+        ) {
+            uint32_t crc = 0;
+
+            block->data = (const uint8_t *)buf;
+            block->len = len;
+            block->pos = CIRCULAR_QUEUE_BLOCK_HDR_SIZE;
+            memcpy(&block->count, block->data, sizeof(block->count));
+            memcpy(&crc, &block->data[sizeof(block->count)], sizeof(crc));
+
+            // a broken block is dropped and counted, it would stall the queue otherwise
+            ret = _block_crc(block->data, len) == crc;
+            if (!ret) cq->dropped++;
+            ret = _dequeue_commit(cq, fd, sizeof(len) + len, 1) && ret;
+        }
+        _close_medium(cq, fd);
+    }
+    CIRCULAR_QUEUE_UNLOCK(cq->dequeue_mutex);
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_block_next(circular_queue_block_t *block, const void **elem, uint16_t *elem_size) {
+    uint8_t ret = 0;
+    uint16_t size = 0;
+
+    if (block && elem && elem_size && block->pos + sizeof(size) <= block->len) {
+        memcpy(&size, &block->data[block->pos], sizeof(size));
+
+        if (block->pos + sizeof(size) + size <= block->len) {
+            *elem = &block->data[block->pos + sizeof(size)];
+            *elem_size = size;
+            block->pos += sizeof(size) + size;
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+static uint8_t _block_start(circular_queue_t *cq) {
+    uint8_t ret = 0;
+    uint16_t size = cq->block_size? cq->block_size : SPIFFS_CIRCULAR_QUEUE_BLOCK_SIZE;
+    circular_queue_block_buffer_t *blk = NULL;
+
+    // a block holds one elem at least and is written as one queue elem
+    uint8_t fits = size > CIRCULAR_QUEUE_BLOCK_HDR_SIZE + sizeof(uint16_t) && sizeof(uint16_t) + size <= cq->max_size;
+#if SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE
+    fits = fits && size < SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE;
+#endif
+
+    if (fits && (blk = (circular_queue_block_buffer_t *)malloc(sizeof(circular_queue_block_buffer_t) + size))) {
+        blk->size = size;
+        blk->len = CIRCULAR_QUEUE_BLOCK_HDR_SIZE;
+        blk->count = 0;
+        blk->data = (uint8_t *)(blk + 1);
+        cq->block = blk;
+        ret = 1;
+    }
+
+    return ret;
+}
+
+// not null-pointer safe
+static uint8_t _block_write(circular_queue_t *cq, circular_queue_block_buffer_t *blk) {
+    uint8_t ret = 0;
+    FILE *fd = NULL;
+
+    memcpy(blk->data, &blk->count, sizeof(blk->count));
+    uint32_t crc = _block_crc(blk->data, blk->len);
+    memcpy(&blk->data[sizeof(blk->count)], &crc, sizeof(crc));
+
+    if ((fd = _open_medium(cq, 0))) {
+        circular_queue_iovec_t iov = {blk->data, blk->len};
+
+        if (_enqueue_medium(cq, fd, &iov, 1)) {
+            // the block is in the queue even if the persist fails, it must not be written twice
+            blk->len = CIRCULAR_QUEUE_BLOCK_HDR_SIZE;
+            blk->count = 0;
+            CIRCULAR_QUEUE_LOCK(cq->mutex);
+            ret = _persist_or_defer(cq, fd);
+            CIRCULAR_QUEUE_UNLOCK(cq->mutex);
+        }
+        _close_medium(cq, fd);
+    }
+
+    return ret;
+}
+
+// not null-pointer safe
+static uint32_t _block_crc(const uint8_t *block, const uint16_t len) {
+    uint32_t crc = esp_rom_crc32_le(0, block, sizeof(uint16_t));
+
+    return esp_rom_crc32_le(crc, &block[CIRCULAR_QUEUE_BLOCK_HDR_SIZE], len - CIRCULAR_QUEUE_BLOCK_HDR_SIZE);
+}
+
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+static uint8_t _scan_block_crc(const circular_queue_t *cq, FILE *fd, circular_queue_scan_cache_t *cache, 
+                               const uint32_t idx, const uint32_t total) {
+    uint8_t hdr[CIRCULAR_QUEUE_BLOCK_HDR_SIZE];
+    uint32_t data_idx = (idx + sizeof(uint16_t)) % cq->max_size;
+    uint32_t crc = 0, expected = 0;
+    uint8_t ret = total >= sizeof(uint16_t) + CIRCULAR_QUEUE_BLOCK_HDR_SIZE;
+
+    for (uint32_t i = 0; ret && i < sizeof(hdr); i++) {
+        ret = _scan_byte(cq, fd, cache, (data_idx + i) % cq->max_size, &hdr[i]);
+    }
+    if (ret) {
+        crc = esp_rom_crc32_le(0, hdr, sizeof(uint16_t));
+        memcpy(&expected, &hdr[sizeof(uint16_t)], sizeof(expected));
+    }
+    // elems bytes through the scan cache, the block may wrap around the file end
+    for (uint32_t i = sizeof(hdr); ret && i < total - sizeof(uint16_t); i++) {
+        uint8_t byte = 0;
+
+        ret = _scan_byte(cq, fd, cache, (data_idx + i) % cq->max_size, &byte);
+        crc = esp_rom_crc32_le(crc, &byte, 1);
+    }
+
+    return ret && crc == expected;
+}
+#endif
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+uint8_t spiffs_circular_queue_multi_init(circular_queue_multi_t *mq) {
+    uint8_t ret = mq->queues_count && mq->queues_count <= SPIFFS_CIRCULAR_QUEUE_MULTI_MAX_QUEUES && 
+                  mq->block_size && mq->blocks_count && mq->blocks_count < CIRCULAR_QUEUE_MULTI_NO_BLOCK;
+
+    ret = ret && _call_once(&_registry_state, _registry_start);
+
+    if (ret && !esp_spiffs_mounted(NULL)) {
+        ret = _mount_spiffs();
+    }
+
+    if (ret) {
+        // geometry may differ on re-initialization
+        free(mq->next);
+        ret = (mq->next = (uint16_t *)malloc(mq->blocks_count*sizeof(uint16_t))) != NULL;
+    }
+
+    if (ret) {
+        struct stat sb;
+        FILE *fd = NULL;
+
+        // stat returns 0 upon succes (file exists) and -1 on failure (does not)
+        if (stat(mq->fn, &sb) < 0) {
+            if ((fd = _pool_open(mq, mq->fn, 1))) {
+                mq->flags.value = 0;
+                mq->flags.fields.queue_type = CIRCULAR_QUEUE_TYPE_SPIFFS_MULTI;
+                for (uint8_t i = 0; i < mq->queues_count; i++) {
+                    mq->lanes[i].head_blk = mq->lanes[i].tail_blk = CIRCULAR_QUEUE_MULTI_NO_BLOCK;
+                    mq->lanes[i].head_off = mq->lanes[i].tail_off = 0;
+                    mq->lanes[i].count = 0;
+                }
+                // all blocks chained in the free list
+                for (uint16_t i = 0; i < mq->blocks_count; i++) {
+                    mq->next[i] = i + 1 < mq->blocks_count? i + 1 : CIRCULAR_QUEUE_MULTI_NO_BLOCK;
+                }
+                mq->free_blk = 0;
+                mq->free_count = mq->blocks_count;
+
+                uint8_t nwritten = CIRCULAR_QUEUE_FWRITE(&(mq->flags.value), 1, sizeof(mq->flags.value), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(mq->queues_count), 1, sizeof(mq->queues_count), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(mq->block_size), 1, sizeof(mq->block_size), fd);
+                nwritten += CIRCULAR_QUEUE_FWRITE(&(mq->blocks_count), 1, sizeof(mq->blocks_count), fd);
+
+                // a new header is written as a whole
+                mq->dirty = 1;
+                mq->dirty_lanes = (uint32_t)((1ull << mq->queues_count) - 1);
+                mq->dirty_first = 0;
+                mq->dirty_last = mq->blocks_count - 1;
+
+                // blocks are taken in any order, so the data area is allocated now
+                ret = nwritten == CIRCULAR_QUEUE_MULTI_HDR_FIXED - sizeof(uint16_t)*2 && 
+                      _multi_persist(mq, fd) && _fill_medium(fd, (uint32_t)mq->blocks_count*mq->block_size);
+                _pool_close(fd);
+            } else {
+                ret = 0;
+            }
+        } else {
+            if ((fd = _pool_open(mq, mq->fn, 0))) {
+                ret = _multi_load(mq, fd);
+                _pool_close(fd);
+            } else {
+                ret = 0;
+            }
+        }
+    }
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    if (ret && !mq->mutex) {
+        ret = (mq->mutex = xSemaphoreCreateRecursiveMutex()) != NULL;
+    }
+#endif
+
+    if (ret) {
+        mq->batch_fd = NULL;
+        mq->batch_depth = 0;
+        mq->dirty = 0;
+        mq->dirty_lanes = 0;
+        mq->dirty_first = CIRCULAR_QUEUE_MULTI_NO_BLOCK;
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_multi_enqueue(circular_queue_multi_t *mq, const uint8_t queue_id, 
+                                            const void *elem, const uint16_t elem_size) {
+    uint8_t ret = 0;
+
+    if (queue_id < mq->queues_count && elem) {
+        CIRCULAR_QUEUE_LOCK_RECURSIVE(mq->mutex);
+        circular_queue_lane_t *lane = &mq->lanes[queue_id];
+        uint16_t tail_room = lane->tail_blk != CIRCULAR_QUEUE_MULTI_NO_BLOCK? mq->block_size - lane->tail_off : 0;
+        FILE *fd = NULL;
+
+        if ((uint32_t)sizeof(elem_size) + elem_size <= tail_room + (uint32_t)mq->free_count*mq->block_size &&
+            (fd = _multi_open(mq))
+        ) {
+            uint16_t blk = tail_room? lane->tail_blk : mq->free_blk;
+            uint16_t off = tail_room? lane->tail_off : 0;
+            uint16_t size = elem_size;
+
+            // while written, the queue chain goes on with the free chain
+            if (lane->tail_blk != CIRCULAR_QUEUE_MULTI_NO_BLOCK) _multi_link(mq, lane->tail_blk, mq->free_blk);
+
+            if (_multi_io(mq, fd, &blk, &off, &size, sizeof(size), 1) && 
+                _multi_io(mq, fd, &blk, &off, (void *)elem, elem_size, 1)
+            ) {
+                // free blocks written up to blk now belong to the queue
+                if (blk != lane->tail_blk) {
+                    if (lane->tail_blk == CIRCULAR_QUEUE_MULTI_NO_BLOCK) {
+                        lane->head_blk = mq->free_blk;
+                        lane->head_off = 0;
+                    }
+                    while (mq->free_blk != blk) {
+                        mq->free_blk = mq->next[mq->free_blk];
+                        mq->free_count--;
+                    }
+                    mq->free_blk = mq->next[blk];
+                    mq->free_count--;
+                    mq->dirty = 1;
+                }
+                _multi_link(mq, blk, CIRCULAR_QUEUE_MULTI_NO_BLOCK);
+
+                lane->tail_blk = blk;
+                lane->tail_off = off;
+                lane->count++;
+                mq->dirty_lanes |= 1ul << queue_id;
+                ret = 1;
+            } else if (lane->tail_blk != CIRCULAR_QUEUE_MULTI_NO_BLOCK) {
+                _multi_link(mq, lane->tail_blk, CIRCULAR_QUEUE_MULTI_NO_BLOCK);
+            }
+
+            ret = _multi_close(mq, fd) && ret;
+        }
+        CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_multi_dequeue(circular_queue_multi_t *mq, const uint8_t queue_id, 
+                                            void *elem, uint16_t *elem_size) {
+    uint8_t ret = 0;
+
+    if (queue_id < mq->queues_count) {
+        CIRCULAR_QUEUE_LOCK_RECURSIVE(mq->mutex);
+        circular_queue_lane_t *lane = &mq->lanes[queue_id];
+        FILE *fd = NULL;
+
+        if (lane->count && (fd = _multi_open(mq))) {
+            uint16_t blk = 0, off = 0;
+
+            if (_multi_read(mq, fd, lane, elem, elem_size, &blk, &off)) {
+                // blocks read through go back to the free chain
+                while (lane->head_blk != blk) {
+                    uint16_t freed = lane->head_blk;
+
+                    lane->head_blk = mq->next[freed];
+                    _multi_release(mq, freed);
+                }
+
+                if (--lane->count) {
+                    lane->head_off = off;
+                } else { // an empty queue holds no block
+                    _multi_release(mq, blk);
+                    lane->head_blk = lane->tail_blk = CIRCULAR_QUEUE_MULTI_NO_BLOCK;
+                    lane->head_off = lane->tail_off = 0;
+                }
+                mq->dirty_lanes |= 1ul << queue_id;
+                ret = 1;
+            }
+
+            ret = _multi_close(mq, fd) && ret;
+        }
+        CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_multi_front(circular_queue_multi_t *mq, const uint8_t queue_id, 
+                                          void *elem, uint16_t *elem_size) {
+    uint8_t ret = 0;
+
+    if (queue_id < mq->queues_count) {
+        CIRCULAR_QUEUE_LOCK_RECURSIVE(mq->mutex);
+        FILE *fd = NULL;
+
+        if (mq->lanes[queue_id].count && (fd = _multi_open(mq))) {
+            uint16_t blk = 0, off = 0;
+
+            ret = _multi_read(mq, fd, &mq->lanes[queue_id], elem, elem_size, &blk, &off);
+            ret = _multi_close(mq, fd) && ret;
+        }
+        CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+    }
+
+    return ret;
+}
+
+uint16_t spiffs_circular_queue_multi_get_count(circular_queue_multi_t *mq, const uint8_t queue_id) {
+    uint16_t ret = 0;
+
+    if (queue_id < mq->queues_count) {
+        CIRCULAR_QUEUE_LOCK_RECURSIVE(mq->mutex);
+        ret = mq->lanes[queue_id].count;
+        CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+    }
+
+    return ret;
+}
+
+uint32_t spiffs_circular_queue_multi_available_space(circular_queue_multi_t *mq) {
+    CIRCULAR_QUEUE_LOCK_RECURSIVE(mq->mutex);
+    uint32_t ret = (uint32_t)mq->free_count*mq->block_size;
+    CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_multi_batch_begin(circular_queue_multi_t *mq) {
+    uint8_t ret = 1;
+
+    CIRCULAR_QUEUE_LOCK_RECURSIVE(mq->mutex);
+    if (!mq->batch_depth) {
+        ret = (mq->batch_fd = _pool_open(mq, mq->fn, 0)) != NULL;
+    }
+
+    if (ret) {
+        mq->batch_depth++;
+    } else {
+        CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_multi_batch_end(circular_queue_multi_t *mq) {
+    uint8_t ret = 0;
+
+    // the lock is held by the batch owner
+    if (mq->batch_depth) {
+        ret = 1;
+        if (!--mq->batch_depth) {
+            FILE *fd = mq->batch_fd;
+
+            mq->batch_fd = NULL;
+            ret = _multi_close(mq, fd);
+        }
+        CIRCULAR_QUEUE_UNLOCK_RECURSIVE(mq->mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_multi_free(circular_queue_multi_t *mq, const uint8_t unmount_spiffs) {
+    uint8_t ret = 0;
+
+    _pool_evict(mq);
+
+    if (!remove(mq->fn)) {
+        ret = 1;
+        if (unmount_spiffs) {
+            // other queues' handles don't survive unmount
+            _pool_evict(NULL);
+            ret = _unmount_spiffs();
+        }
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+        if (mq->mutex) vSemaphoreDelete(mq->mutex);
+#endif
+        free(mq->next);
+        memset(mq, 0x0, sizeof(circular_queue_multi_t));
+    }
+
+    return ret;
+}
+
+static uint8_t _multi_persist(circular_queue_multi_t *mq, FILE *fd) {
+    uint8_t ret = 1;
+
+    // only what the operations changed is written, the geometry never changes
+    if (mq->dirty) {
+        uint32_t nwritten = 0;
+
+        ret = !fseek(fd, CIRCULAR_QUEUE_MULTI_HDR_FIXED - sizeof(uint16_t)*2, SEEK_SET);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(mq->free_blk), 1, sizeof(mq->free_blk), fd);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(mq->free_count), 1, sizeof(mq->free_count), fd);
+        ret = ret && nwritten == sizeof(uint16_t)*2;
+    }
+
+    for (uint8_t i = 0; ret && i < mq->queues_count; i++) {
+        if (mq->dirty_lanes & (1ul << i)) ret = _multi_lane_write(mq, fd, i);
+    }
+
+    if (ret && mq->dirty_first != CIRCULAR_QUEUE_MULTI_NO_BLOCK) {
+        uint16_t count = mq->dirty_last - mq->dirty_first + 1;
+
+        // links of the blocks in between are rewritten unchanged
+        ret = !fseek(fd, _multi_data_offset(mq) - (uint32_t)(mq->blocks_count - mq->dirty_first)*sizeof(uint16_t), SEEK_SET) &&
+              CIRCULAR_QUEUE_FWRITE(&(mq->next[mq->dirty_first]), sizeof(uint16_t), count, fd) == count;
+    }
+
+    if (ret && (mq->dirty || mq->dirty_lanes || mq->dirty_first != CIRCULAR_QUEUE_MULTI_NO_BLOCK)) {
+        ret = _sync_medium(fd);
+    }
+
+    // on fail all changed parts are written again by the next persist
+    if (ret) {
+        mq->dirty = 0;
+        mq->dirty_lanes = 0;
+        mq->dirty_first = CIRCULAR_QUEUE_MULTI_NO_BLOCK;
+    }
+
+    return ret;
+}
+
+static uint8_t _multi_lane_write(const circular_queue_multi_t *mq, FILE *fd, const uint8_t queue_id) {
+    const circular_queue_lane_t *lane = &mq->lanes[queue_id];
+    uint32_t nwritten = 0;
+
+    uint8_t ret = !fseek(fd, CIRCULAR_QUEUE_MULTI_HDR_FIXED + (uint32_t)queue_id*CIRCULAR_QUEUE_MULTI_LANE_SIZE, SEEK_SET);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(lane->head_blk), 1, sizeof(lane->head_blk), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(lane->tail_blk), 1, sizeof(lane->tail_blk), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(lane->head_off), 1, sizeof(lane->head_off), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(lane->tail_off), 1, sizeof(lane->tail_off), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(lane->count), 1, sizeof(lane->count), fd);
+
+    return ret && nwritten == CIRCULAR_QUEUE_MULTI_LANE_SIZE;
+}
+
+static uint8_t _multi_load(circular_queue_multi_t *mq, FILE *fd) {
+    uint32_t nread = 0;
+    uint8_t queues_count = 0;
+    uint16_t block_size = 0, blocks_count = 0;
+
+    fseek(fd, 0, SEEK_SET);
+    nread += fread(&(mq->flags.value), 1, sizeof(mq->flags.value), fd);
+    nread += fread(&queues_count, 1, sizeof(queues_count), fd);
+    nread += fread(&block_size, 1, sizeof(block_size), fd);
+    nread += fread(&blocks_count, 1, sizeof(blocks_count), fd);
+
+    // the file must be a container of the same geometry
+    uint8_t ret = nread == CIRCULAR_QUEUE_MULTI_HDR_FIXED - sizeof(uint16_t)*2 &&
+                  mq->flags.fields.queue_type == CIRCULAR_QUEUE_TYPE_SPIFFS_MULTI &&
+                  queues_count == mq->queues_count && block_size == mq->block_size && blocks_count == mq->blocks_count;
+
+    if (ret) {
+        nread += fread(&(mq->free_blk), 1, sizeof(mq->free_blk), fd);
+        nread += fread(&(mq->free_count), 1, sizeof(mq->free_count), fd);
+        for (uint8_t i = 0; i < mq->queues_count; i++) {
+            circular_queue_lane_t *lane = &mq->lanes[i];
+
+            nread += fread(&(lane->head_blk), 1, sizeof(lane->head_blk), fd);
+            nread += fread(&(lane->tail_blk), 1, sizeof(lane->tail_blk), fd);
+            nread += fread(&(lane->head_off), 1, sizeof(lane->head_off), fd);
+            nread += fread(&(lane->tail_off), 1, sizeof(lane->tail_off), fd);
+            nread += fread(&(lane->count), 1, sizeof(lane->count), fd);
+        }
+        nread += fread(mq->next, 1, mq->blocks_count*sizeof(uint16_t), fd);
+
+        ret = nread == _multi_data_offset(mq);
+    }
+
+    return ret;
+}
+
+static FILE *_multi_open(circular_queue_multi_t *mq) {
+    return mq->batch_fd? mq->batch_fd : _pool_open(mq, mq->fn, 0);
+}
+
+static uint8_t _multi_close(circular_queue_multi_t *mq, FILE *fd) {
+    uint8_t ret = 1;
+
+    // a batch persists once at its end
+    if (fd != mq->batch_fd) {
+        ret = _multi_persist(mq, fd);
+        _pool_close(fd);
+    }
+
+    return ret;
+}
+
+static uint8_t _multi_io(const circular_queue_multi_t *mq, FILE *fd, uint16_t *blk, uint16_t *off, 
+                         void *data, const uint16_t size, const uint8_t write) {
+    uint8_t ret = 1;
+    uint16_t done = 0;
+
+    while (ret && done < size) {
+        if (*off == mq->block_size) { // block end, go on with the chain
+            *blk = mq->next[*blk];
+            *off = 0;
+        }
+
+        uint16_t chunk = mq->block_size - *off < size - done? mq->block_size - *off : size - done;
+
+        ret = *blk < mq->blocks_count && 
+              !fseek(fd, _multi_data_offset(mq) + (uint32_t)*blk*mq->block_size + *off, SEEK_SET);
+        if (ret) {
+            ret = chunk == (write? CIRCULAR_QUEUE_FWRITE((uint8_t *)data + done, 1, chunk, fd) : fread((uint8_t *)data + done, 1, chunk, fd));
+        }
+
+        done += chunk;
+        *off += chunk;
+    }
+
+    return ret;
+}
+
+static uint8_t _multi_read(const circular_queue_multi_t *mq, FILE *fd, const circular_queue_lane_t *lane, 
+                           void *elem, uint16_t *elem_size, uint16_t *blk, uint16_t *off) {
+    uint16_t size = 0;
+
+    *blk = lane->head_blk;
+    *off = lane->head_off;
+
+    uint8_t ret = _multi_io(mq, fd, blk, off, &size, sizeof(size), 0) && elem && 
+                  _multi_io(mq, fd, blk, off, elem, size, 0);
+
+    if (ret && elem_size) *elem_size = size;
+
+    return ret;
+}
+
+static inline void _multi_release(circular_queue_multi_t *mq, const uint16_t blk) {
+    _multi_link(mq, blk, mq->free_blk);
+    mq->free_blk = blk;
+    mq->free_count++;
+    mq->dirty = 1;
+}
+
+static inline void _multi_link(circular_queue_multi_t *mq, const uint16_t blk, const uint16_t next) {
+    mq->next[blk] = next;
+    if (mq->dirty_first == CIRCULAR_QUEUE_MULTI_NO_BLOCK) {
+        mq->dirty_first = mq->dirty_last = blk;
+    } else if (blk < mq->dirty_first) {
+        mq->dirty_first = blk;
+    } else if (blk > mq->dirty_last) {
+        mq->dirty_last = blk;
+    }
+}
+
+static inline uint32_t _multi_data_offset(const circular_queue_multi_t *mq) {
+    return CIRCULAR_QUEUE_MULTI_HDR_FIXED + mq->queues_count*CIRCULAR_QUEUE_MULTI_LANE_SIZE + 
+           mq->blocks_count*sizeof(uint16_t);
+}
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+uint8_t spiffs_circular_queue_prio_init(circular_queue_prio_t *pq) {
+    uint8_t ret = pq->levels_count && pq->levels_count <= SPIFFS_CIRCULAR_QUEUE_PRIO_MAX_LEVELS;
+
+    ret = ret && _call_once(&_registry_state, _registry_start);
+
+    if (ret && !esp_spiffs_mounted(NULL)) {
+        ret = _mount_spiffs();
+    }
+
+    if (ret) {
+        struct stat sb;
+        FILE *fd = NULL;
+
+        // stat returns 0 upon succes (file exists) and -1 on failure (does not)
+        if (stat(pq->fn, &sb) < 0) {
+            if ((fd = _pool_open(pq, pq->fn, 1))) {
+                uint32_t data_size = 0;
+
+                pq->flags.value = 0;
+                pq->flags.fields.queue_type = CIRCULAR_QUEUE_TYPE_SPIFFS_PRIO;
+                for (uint8_t i = 0; i < pq->levels_count; i++) {
+                    circular_queue_level_t *lvl = &pq->levels[i];
+
+                    lvl->front_idx = lvl->back_idx = 0;
+                    lvl->count = 0;
+                    // set default max size, if not specified
+                    if (!lvl->max_size) lvl->max_size = CIRCULAR_QUEUE_DEFAULT_MAX_SIZE;
+                    data_size += lvl->max_size;
+                }
+
+                // levels are written in any order, so their regions are allocated now
+                ret = _prio_persist(pq, fd) && _fill_medium(fd, data_size);
+                _pool_close(fd);
+            } else {
+                ret = 0;
+            }
+        } else {
+            if ((fd = _pool_open(pq, pq->fn, 0))) {
+                ret = _prio_load(pq, fd);
+                _pool_close(fd);
+            } else {
+                ret = 0;
+            }
+        }
+    }
+
+    if (ret) {
+        pq->nonempty = 0;
+        for (uint8_t i = 0; i < pq->levels_count; i++) {
+            if (pq->levels[i].count) pq->nonempty |= 1u << i;
+        }
+    }
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    if (ret && !pq->mutex) {
+        ret = (pq->mutex = xSemaphoreCreateMutex()) != NULL;
+    }
+#endif
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_prio_enqueue(circular_queue_prio_t *pq, const uint8_t level, 
+                                           const void *elem, const uint16_t elem_size) {
+    uint8_t ret = 0;
+
+    if (level < pq->levels_count && elem) {
+        CIRCULAR_QUEUE_LOCK(pq->mutex);
+        circular_queue_level_t *lvl = &pq->levels[level];
+        FILE *fd = NULL;
+
+        if (_prio_level_used(lvl) + sizeof(elem_size) + elem_size <= lvl->max_size && 
+            (fd = _pool_open(pq, pq->fn, 0))
+        ) {
+            uint32_t idx = lvl->back_idx;
+            uint16_t size = elem_size;
+
+            if (_ring_io(fd, _prio_level_offset(pq, level), lvl->max_size, &idx, &size, sizeof(size), 1) && 
+                _ring_io(fd, _prio_level_offset(pq, level), lvl->max_size, &idx, (void *)elem, elem_size, 1)
+            ) {
+                lvl->back_idx = idx;
+                lvl->count++;
+                pq->nonempty |= 1u << level;
+                ret = _prio_persist(pq, fd);
+            }
+            _pool_close(fd);
+        }
+        CIRCULAR_QUEUE_UNLOCK(pq->mutex);
+    }
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_prio_dequeue(circular_queue_prio_t *pq, void *elem, uint16_t *elem_size, uint8_t *level) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(pq->mutex);
+    FILE *fd = NULL;
+
+    if (pq->nonempty && (fd = _pool_open(pq, pq->fn, 0))) {
+        uint8_t lvl_n = 0;
+        uint32_t idx = 0;
+
+        if (_prio_read(pq, fd, elem, elem_size, &lvl_n, &idx)) {
+            circular_queue_level_t *lvl = &pq->levels[lvl_n];
+
+            lvl->front_idx = idx;
+            if (!--lvl->count) pq->nonempty &= ~(1u << lvl_n);
+            if (level) *level = lvl_n;
+            ret = _prio_persist(pq, fd);
+        }
+        _pool_close(fd);
+    }
+    CIRCULAR_QUEUE_UNLOCK(pq->mutex);
+
+    return ret;
+}
+
+uint8_t spiffs_circular_queue_prio_front(circular_queue_prio_t *pq, void *elem, uint16_t *elem_size, uint8_t *level) {
+    uint8_t ret = 0;
+
+    CIRCULAR_QUEUE_LOCK(pq->mutex);
+    FILE *fd = NULL;
+
+    if (pq->nonempty && (fd = _pool_open(pq, pq->fn, 0))) {
+        uint8_t lvl_n = 0;
+        uint32_t idx = 0;
+
+        ret = _prio_read(pq, fd, elem, elem_size, &lvl_n, &idx);
+        if (ret && level) *level = lvl_n;
+        _pool_close(fd);
+    }
+    CIRCULAR_QUEUE_UNLOCK(pq->mutex);
+
+    return ret;
+}
+
+uint32_t spiffs_circular_queue_prio_nonempty(const circular_queue_prio_t *pq) {
+    return pq->nonempty;
+}
+
+uint16_t spiffs_circular_queue_prio_get_count(const circular_queue_prio_t *pq, const uint8_t level) {
+    return level < pq->levels_count? pq->levels[level].count : 0;
+}
+
+uint8_t spiffs_circular_queue_prio_free(circular_queue_prio_t *pq, const uint8_t unmount_spiffs) {
+    uint8_t ret = 0;
+
+    _pool_evict(pq);
+
+    if (!remove(pq->fn)) {
+        ret = 1;
+        if (unmount_spiffs) {
+            // other queues' handles don't survive unmount
+            _pool_evict(NULL);
+            ret = _unmount_spiffs();
+        }
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+        if (pq->mutex) vSemaphoreDelete(pq->mutex);
+#endif
+        memset(pq, 0x0, sizeof(circular_queue_prio_t));
+    }
+
+    return ret;
+}
+
+static uint8_t _prio_persist(const circular_queue_prio_t *pq, FILE *fd) {
+    uint32_t nwritten = 0;
+
+    fseek(fd, 0, SEEK_SET);
+    // one header for all levels, rewritten as a whole
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(pq->flags.value), 1, sizeof(pq->flags.value), fd);
+    nwritten += CIRCULAR_QUEUE_FWRITE(&(pq->levels_count), 1, sizeof(pq->levels_count), fd);
+    for (uint8_t i = 0; i < pq->levels_count; i++) {
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(pq->levels[i].front_idx), 1, sizeof(pq->levels[i].front_idx), fd);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(pq->levels[i].back_idx), 1, sizeof(pq->levels[i].back_idx), fd);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(pq->levels[i].max_size), 1, sizeof(pq->levels[i].max_size), fd);
+        nwritten += CIRCULAR_QUEUE_FWRITE(&(pq->levels[i].count), 1, sizeof(pq->levels[i].count), fd);
+    }
+
+    return (nwritten == _prio_level_offset(pq, 0)) && _sync_medium(fd);
+}
+
+static uint8_t _prio_load(circular_queue_prio_t *pq, FILE *fd) {
+    uint32_t nread = 0;
+    uint8_t levels_count = 0;
+
+    fseek(fd, 0, SEEK_SET);
+    nread += fread(&(pq->flags.value), 1, sizeof(pq->flags.value), fd);
+    nread += fread(&levels_count, 1, sizeof(levels_count), fd);
+
+    // the file must be a priority queue of the same levels
+    uint8_t ret = nread == CIRCULAR_QUEUE_PRIO_HDR_FIXED && 
+                  pq->flags.fields.queue_type == CIRCULAR_QUEUE_TYPE_SPIFFS_PRIO && levels_count == pq->levels_count;
+
+    for (uint8_t i = 0; ret && i < pq->levels_count; i++) {
+        nread += fread(&(pq->levels[i].front_idx), 1, sizeof(pq->levels[i].front_idx), fd);
+        nread += fread(&(pq->levels[i].back_idx), 1, sizeof(pq->levels[i].back_idx), fd);
+        nread += fread(&(pq->levels[i].max_size), 1, sizeof(pq->levels[i].max_size), fd);
+        nread += fread(&(pq->levels[i].count), 1, sizeof(pq->levels[i].count), fd);
+    }
+
+    return ret && nread == _prio_level_offset(pq, 0);
+}
+
+static uint8_t _prio_read(const circular_queue_prio_t *pq, FILE *fd, void *elem, uint16_t *elem_size, 
+                          uint8_t *level, uint32_t *idx) {
+    uint16_t size = 0;
+    // lowest set bit is the highest priority non-empty level
+    uint8_t lvl_n = __builtin_ctz(pq->nonempty);
+    const circular_queue_level_t *lvl = &pq->levels[lvl_n];
+
+    *idx = lvl->front_idx;
+    uint8_t ret = _ring_io(fd, _prio_level_offset(pq, lvl_n), lvl->max_size, idx, &size, sizeof(size), 0) && elem &&
+                  _ring_io(fd, _prio_level_offset(pq, lvl_n), lvl->max_size, idx, elem, size, 0);
+
+    if (ret) {
+        if (elem_size) *elem_size = size;
+        *level = lvl_n;
+    }
+
+    return ret;
+}
+
+static uint8_t _ring_io(FILE *fd, const uint32_t region, const uint32_t region_size, uint32_t *idx, 
+                        void *data, const uint16_t size, const uint8_t write) {
+    uint8_t ret = 1;
+    uint16_t done = 0;
+
+    // at most two chunks, before and after the region end
+    while (ret && done < size) {
+        uint32_t chunk = region_size - *idx < (uint32_t)(size - done)? region_size - *idx : size - done;
+
+        ret = !fseek(fd, region + *idx, SEEK_SET) && 
+              chunk == (write? CIRCULAR_QUEUE_FWRITE((uint8_t *)data + done, 1, chunk, fd) : fread((uint8_t *)data + done, 1, chunk, fd));
+
+        done += chunk;
+        *idx = (*idx + chunk) % region_size;
     }
 
     return ret;
-}
\ No newline at end of file
+}
+
+static inline uint32_t _prio_level_used(const circular_queue_level_t *lvl) {
+    uint32_t used = 0;
+
+    if (lvl->count) {
+        used = lvl->back_idx > lvl->front_idx? lvl->back_idx - lvl->front_idx : 
+                                               lvl->max_size - lvl->front_idx + lvl->back_idx;
+    }
+
+    return used;
+}
+
+static inline uint32_t _prio_level_offset(const circular_queue_prio_t *pq, const uint8_t level) {
+    uint32_t offset = CIRCULAR_QUEUE_PRIO_HDR_FIXED + pq->levels_count*CIRCULAR_QUEUE_PRIO_LEVEL_HDR;
+
+    for (uint8_t i = 0; i < level; i++) {
+        offset += pq->levels[i].max_size;
+    }
+
+    return offset;
+}
+#endif
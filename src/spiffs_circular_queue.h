@@ -8,29 +8,232 @@
 #define __SPIFFS_CIRCULAR_QUEUE__H__
 
 #define SPIFFS_MAX_FILES_COUNT                    (3u)    ///< Maximum queue files that could open at the same time.
+#define SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE        (0u)    ///< Queue files kept open, least recently used closed first, up to SPIFFS_MAX_FILES_COUNT. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE       (16u)   ///< Max queues initialized at the same time, with deferred persist or space manager
 #define SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE       (0u)    ///< Queue elem size upper limit. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_CONSUME_BUFFER_SIZE (512u)  ///< Consume read buffer on the caller's stack, larger elems are read on the heap
 #define SPIFFS_FILE_NAME_MAX_SIZE                 (32u)   ///< SPIFFS maximum allowable file name length
 #define CIRCULAR_QUEUE_DEFAULT_MAX_SIZE           (2048u) ///< Default queue max size in bytes
+#define SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE         (0u)    ///< Per-queue locking for multi-task access. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND        (0u)    ///< RAM ring in front of the queue file, needs thread safety. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_CORE     (0)     ///< Core the front-end flush task is pinned to
+#define SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_PRIORITY (1u)    ///< Front-end flush task priority
+#define SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_STACK    (4096u) ///< Front-end flush task stack size in bytes
+#define SPIFFS_CIRCULAR_QUEUE_FLUSH_PERIOD_MS     (1000u) ///< Front-end flush retry period while the queue is full
+#define SPIFFS_CIRCULAR_QUEUE_FLUSH_BATCH_SIZE    (32u)   ///< Max elems moved to the queue file per open and persist
+#define SPIFFS_CIRCULAR_QUEUE_WAIT                (0u)    ///< Blocking enqueue/dequeue with timeout, needs thread safety. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_WATERMARKS          (0u)    ///< High/low fill level callbacks. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_ISR_STAGING         (0u)    ///< Lock-free staging slots for enqueue from ISR, needs thread safety. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS           (16u)   ///< Staging slots count, power of 2
+#define SPIFFS_CIRCULAR_QUEUE_ISR_SLOT_SIZE       (32u)   ///< Staging slot size, max elem size enqueued from ISR
+#define SPIFFS_CIRCULAR_QUEUE_ASYNC               (0u)    ///< Async enqueue/dequeue served by an I/O worker task, needs thread safety. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_ASYNC_QUEUE_LEN     (16u)   ///< Max async operations pending at the same time
+#define SPIFFS_CIRCULAR_QUEUE_ASYNC_BATCH_SIZE    (16u)   ///< Max async operations merged per open, data sync and persist
+#define SPIFFS_CIRCULAR_QUEUE_IO_TASK_CORE        (0)     ///< Core the async I/O worker task is pinned to
+#define SPIFFS_CIRCULAR_QUEUE_IO_TASK_PRIORITY    (1u)    ///< Async I/O worker task priority
+#define SPIFFS_CIRCULAR_QUEUE_IO_TASK_STACK       (4096u) ///< Async I/O worker task stack size in bytes
+#define SPIFFS_CIRCULAR_QUEUE_MULTI               (0u)    ///< Logical queues sharing one file and data area. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_MULTI_MAX_QUEUES    (8u)    ///< Max logical queues in one container, up to 32
+#define SPIFFS_CIRCULAR_QUEUE_PRIO                (0u)    ///< Multi-level priority queue in one file. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_PRIO_MAX_LEVELS     (8u)    ///< Max priority levels, up to 32
+#define SPIFFS_CIRCULAR_QUEUE_CURSORS             (0u)    ///< Named consumer cursors in the queue header. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS         (4u)    ///< Cursors per queue
+#define SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE    (8u)    ///< Cursor name length, including the terminating null
+#define SPIFFS_CIRCULAR_QUEUE_BLOCKS              (0u)    ///< Block format, elems grouped in blocks with count and CRC. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_BLOCK_SIZE          (512u)  ///< Default block size in bytes, block header included
+#define SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN       (0u)    ///< Validate and repair existing queue files on init. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_SCAN_CHUNK          (256u)  ///< Recovery scan read size in bytes
+#define SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE        (0u)    ///< Init phases timing kept in the queue struct. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_IDLE_GC             (0u)    ///< SPIFFS garbage collection on maintain calls, ESP-IDF 4.4 and later. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_GC_WRITES           (8u)    ///< Next queue writes maintain makes room for
+#define SPIFFS_CIRCULAR_QUEUE_GC_STEP             (4096u) ///< Bytes freed per garbage collection step, one flash sector
+#define SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER       (0u)    ///< Partition usage admission control on init and enqueue. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_HIGH_WATER_PCT      (75u)   ///< Partition usage in percent queues must not push past
+#define SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST    (0u)    ///< Per-queue opt-in header persist on sync calls only. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION     (0u)    ///< Power cut simulation on medium writes, for crash tests only. 0 if disabled
+#define SPIFFS_CIRCULAR_QUEUE_FAULT_PAGE_SIZE     (256u)  ///< Default flash page size of the power cut simulation, SPIFFS logical page
 
 #include <Arduino.h>
 
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+#include "freertos/event_groups.h"
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE > SPIFFS_MAX_FILES_COUNT
+#error SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE must be from 0 to SPIFFS_MAX_FILES_COUNT
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND && !SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#error SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND requires SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT && !SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#error SPIFFS_CIRCULAR_QUEUE_WAIT requires SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING && !SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#error SPIFFS_CIRCULAR_QUEUE_ISR_STAGING requires SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING && (SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS & (SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS - 1))
+#error SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS must be a power of 2
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC && !SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#error SPIFFS_CIRCULAR_QUEUE_ASYNC requires SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_PRIO && SPIFFS_CIRCULAR_QUEUE_PRIO_MAX_LEVELS > 32
+#error SPIFFS_CIRCULAR_QUEUE_PRIO_MAX_LEVELS must fit the non-empty levels bitmap
+#endif
+
 typedef struct _circular_queue_t circular_queue_t;
 
 /// Queue types enum, it will go populating with the development of the project
 typedef enum {
     CIRCULAR_QUEUE_TYPE_SPIFFS = 0,
+    CIRCULAR_QUEUE_TYPE_SPIFFS_MULTI,
+    CIRCULAR_QUEUE_TYPE_SPIFFS_PRIO,
 } circular_queue_type_t;
 
 /// Union with a bitfield for easy access to queue flags
 typedef union {
     struct {
         unsigned char queue_type        : 4;
-        unsigned char reserved          : 3;
+        unsigned char reserved          : 1;
+        unsigned char blocks            : 1;
+        unsigned char cursors           : 1;
         unsigned char fixed_elem_size   : 1;
     } fields;
     unsigned char value;
 } circular_queue_flags_t;
 
+/// Elem fragment for the scatter-gather enqueue
+typedef struct {
+    const void *base;               ///< Fragment data
+    uint16_t len;                   ///< Fragment size in bytes
+} circular_queue_iovec_t;
+
+/// Elem writer of spiffs_circular_queue_enqueue_with, streams the elem straight to the queue file
+typedef struct {
+    const circular_queue_t *cq;     ///< Queue being written
+    FILE *fd;                       ///< Queue file handle
+    uint32_t idx;                   ///< Queue index of the next elem byte
+    uint16_t written;               ///< Elem bytes written so far
+    uint16_t max_len;               ///< Elem size limit
+    uint8_t failed;                 ///< A write failed or went past max_len, the elem is dropped
+} circular_queue_writer_t;
+
+/**
+ *	Elem serialization callback of spiffs_circular_queue_enqueue_with. Writes the elem in one or more
+ *  spiffs_circular_queue_writer_put calls, i.e. from a CBOR or protobuf encoder output callback.
+ *
+ *	@param[in] writer 		Elem writer to pass to spiffs_circular_queue_writer_put
+ *	@param[in] ctx 			User context given on the enqueue_with call
+ *
+ *	@return					1 to enqueue the written elem and 0 to drop it
+ */
+typedef uint8_t (*circular_queue_writer_cb_t)(circular_queue_writer_t *writer, void *ctx);
+
+/**
+ *	Elem callback of spiffs_circular_queue_consume. The elem points into the consume read buffer, it is valid
+ *  until the callback returns.
+ *
+ *	@param[in] elem 		Pointer to the elem data
+ *	@param[in] elem_size 	Elem size
+ *	@param[in] ctx 			User context given on the consume call
+ *
+ *	@return					1 to consume the elem and go on, 0 to stop and leave the elem in the queue
+ */
+typedef uint8_t (*circular_queue_consume_cb_t)(const void *elem, const uint16_t elem_size, void *ctx);
+
+/// Frame of front elems read by spiffs_circular_queue_dequeue_frame, dequeued by spiffs_circular_queue_frame_commit
+typedef struct {
+    uint32_t seq;                   ///< Queue dequeue sequence number the frame was read at
+    uint32_t size;                  ///< Frame size in bytes
+    uint16_t count;                 ///< Elems in the frame
+} circular_queue_frame_t;
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+/// Block read by spiffs_circular_queue_block_dequeue, its elems are walked with spiffs_circular_queue_block_next
+typedef struct {
+    const uint8_t *data;            ///< Block bytes in the caller's buffer, block header included
+    uint16_t len;                   ///< Block size in bytes
+    uint16_t count;                 ///< Elems in the block
+    uint16_t pos;                   ///< Next elem offset
+} circular_queue_block_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+/// Enqueue durability levels, what has reached the flash when the enqueue returns
+typedef enum {
+    CIRCULAR_QUEUE_DURABILITY_NONE = 0, ///< Buffered in the RAM front-end if started, as DATA otherwise
+    CIRCULAR_QUEUE_DURABILITY_DATA,     ///< Elem data synced, header persisted later
+    CIRCULAR_QUEUE_DURABILITY_FULL,     ///< Elem data and header synced
+} circular_queue_durability_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+/// Named consumer cursor. The slowest cursors are at the queue front, space is reclaimed up to them
+typedef struct {
+    char name[SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE]; ///< Cursor name, empty if the entry is free
+    uint32_t front_idx;             ///< Cursor next elem byte index, valid if ahead
+    uint16_t ahead;                 ///< Elems read by the cursor past the queue front
+} circular_queue_cursor_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE
+/// Last init phases duration in microseconds
+typedef struct {
+    uint32_t mount_us;              ///< SPIFFS mount, 0 if it was mounted already
+    uint32_t stat_us;               ///< Queue file lookup
+    uint32_t open_us;               ///< Queue file open, or create
+    uint32_t header_us;             ///< Header read, or write for a new file
+} circular_queue_init_profile_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+/// Fill level watermark units
+typedef enum {
+    CIRCULAR_QUEUE_WATERMARK_BYTES = 0, ///< Queue data size, as spiffs_circular_queue_size
+    CIRCULAR_QUEUE_WATERMARK_ELEMS,     ///< Queue elems count
+} circular_queue_watermark_unit_t;
+
+/// Crossed watermark
+typedef enum {
+    CIRCULAR_QUEUE_WATERMARK_NONE = 0,  ///< No watermark crossed
+    CIRCULAR_QUEUE_WATERMARK_HIGH,      ///< Fill level rose to the high watermark
+    CIRCULAR_QUEUE_WATERMARK_LOW,       ///< Fill level fell to the low watermark
+} circular_queue_watermark_t;
+
+/**
+ *	Watermark callback. Called from the task whose enqueue or dequeue crossed the watermark, after the queue
+ *  state lock and file handle are released. Keep it short, i.e. notify another task. It may use other queues,
+ *  but must not enqueue to or dequeue from this one, the calling operation is still in progress.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] crossed 		Crossed watermark
+ *	@param[in] ctx 			User context given on registration
+ */
+typedef void (*circular_queue_watermark_cb_t)(circular_queue_t *cq, const circular_queue_watermark_t crossed, void *ctx);
+
+/// Fill level watermarks with hysteresis: high fires once until low is reached and the other way around
+typedef struct {
+    uint32_t high;                  ///< Fill level the high callback fires at
+    uint32_t low;                   ///< Fill level the low callback fires at, below high
+    circular_queue_watermark_unit_t unit; ///< Fill level unit
+    circular_queue_watermark_cb_t cb;     ///< Callback, NULL if not registered
+    void *ctx;                      ///< User context passed to cb
+    uint8_t above;                  ///< High watermark reached and low not yet
+    uint8_t pending;                ///< Crossings not reported yet, reported once the queue file handle is released
+} circular_queue_watermarks_t;
+#endif
+
 /// Main queue struct
 typedef struct _circular_queue_t {
     char fn[SPIFFS_FILE_NAME_MAX_SIZE]; ///< Path to store the queue data in SPIFFS. Mandatory prefix "/spiffs/"
@@ -42,6 +245,59 @@ typedef struct _circular_queue_t {
     uint16_t elem_size;             ///< Queue fixed elem size in bytes
 
     circular_queue_flags_t flags;   ///< Flags for queue type, fixed elem size, etc
+    uint32_t dequeue_seq;           ///< Front moves counter, tells frames read before a dequeue apart
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    SemaphoreHandle_t mutex;         ///< Guards front/back indices, count and the header persist
+    SemaphoreHandle_t enqueue_mutex; ///< Serializes producers, held during the data write
+    SemaphoreHandle_t dequeue_mutex; ///< Serializes consumers, held during the data read
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+    EventGroupHandle_t events;       ///< Data enqueued and space freed events for the waiting calls
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    void *frontend;                  ///< RAM front-end ring and flush task, NULL if not started
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+    void *staging;                   ///< Pre-allocated ISR staging slots, NULL if not started
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+    uint8_t use_cursors;            ///< Set before creating a queue to reserve the cursors table in its header. 0 for none
+    circular_queue_cursor_t cursors[SPIFFS_CIRCULAR_QUEUE_MAX_CURSORS]; ///< Consumer cursors, persisted in the header
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    uint16_t block_size;            ///< Block size in bytes, set before creating a block format queue. 0 for plain elems
+    void *block;                    ///< Block being filled, NULL if not a block format queue
+    uint16_t dropped;               ///< Blocks dropped by block dequeue on a CRC mismatch since init
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+    uint32_t recovery_us;           ///< Last init recovery scan duration in microseconds
+    uint16_t recovered;             ///< Elems dropped by the last init recovery scan
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE
+    circular_queue_init_profile_t init_profile; ///< Last init phases timing
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+    uint32_t file_size;             ///< Queue file size on the medium, grows up to the full size
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    uint8_t deferred;               ///< Header persisted by spiffs_circular_queue_sync only
+    uint8_t dirty;                  ///< Header changed since the last persist
+    uint32_t freed;                 ///< Bytes freed since the last persist, not reused before it
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+    circular_queue_watermarks_t watermarks; ///< Fill level callbacks
+#endif
 
     // Function pointers to get oo flavour 
     uint8_t (*front)(const circular_queue_t*, void*, uint16_t*);
@@ -57,6 +313,78 @@ typedef struct _circular_queue_t {
     uint8_t (*free)(circular_queue_t*, uint8_t);
 } _circular_queue_t;
 
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+/**
+ *	Async operation completion callback. Called from the I/O worker task once the operation is persisted.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct the operation was issued on
+ *	@param[in] result 		1 on success and 0 on fail, same as the synchronous counterpart
+ *  @param[in] elem_size    Enqueued or dequeued elem size
+ *	@param[in] ctx 			User context given on the async call
+ */
+typedef void (*circular_queue_async_cb_t)(circular_queue_t *cq, const uint8_t result, const uint16_t elem_size, void *ctx);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+#define CIRCULAR_QUEUE_MULTI_NO_BLOCK             (0xFFFFu) ///< End of a blocks chain
+
+/// Logical queue of a container, a chain of data blocks read at the head and written at the tail
+typedef struct {
+    uint16_t head_blk;              ///< First block, CIRCULAR_QUEUE_MULTI_NO_BLOCK if the queue is empty
+    uint16_t tail_blk;              ///< Last block
+    uint16_t head_off;              ///< Front elem byte offset in the first block
+    uint16_t tail_off;              ///< Next elem byte offset in the last block
+    uint16_t count;                 ///< Queue nodes count
+} circular_queue_lane_t;
+
+/// Container struct. Hosts several logical queues in one file, with one header and a shared data area
+typedef struct {
+    char fn[SPIFFS_FILE_NAME_MAX_SIZE]; ///< Path to store the container data in SPIFFS. Mandatory prefix "/spiffs/"
+    uint8_t queues_count;           ///< Logical queues count, up to SPIFFS_CIRCULAR_QUEUE_MULTI_MAX_QUEUES
+    uint16_t block_size;            ///< Data area block size in bytes
+    uint16_t blocks_count;          ///< Data area blocks count
+
+    circular_queue_flags_t flags;   ///< Flags for queue type
+    uint16_t free_blk;              ///< First free block, CIRCULAR_QUEUE_MULTI_NO_BLOCK if none
+    uint16_t free_count;            ///< Free blocks count
+    circular_queue_lane_t lanes[SPIFFS_CIRCULAR_QUEUE_MULTI_MAX_QUEUES]; ///< Logical queues
+    uint16_t *next;                 ///< Blocks chain links, next block of each block
+
+    FILE *batch_fd;                 ///< File handle held by an open batch, NULL otherwise
+    uint8_t batch_depth;            ///< Nested batches count
+    uint8_t dirty;                  ///< Free chain head or count changed since the last persist
+    uint32_t dirty_lanes;           ///< Queues changed since the last persist, bit n for queue n
+    uint16_t dirty_first;           ///< First blocks chain link changed since the last persist, 
+                                    ///  CIRCULAR_QUEUE_MULTI_NO_BLOCK if none
+    uint16_t dirty_last;            ///< Last blocks chain link changed since the last persist
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    SemaphoreHandle_t mutex;        ///< Recursive, held during every operation and for a whole batch
+#endif
+} circular_queue_multi_t;
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+/// Priority level, a ring region of the priority queue file
+typedef struct {
+    uint32_t front_idx;             ///< Level front byte index
+    uint32_t back_idx;              ///< Level back byte index
+    uint16_t count;                 ///< Level nodes count
+    uint32_t max_size;              ///< Level ring size in bytes, default if 0 on init
+} circular_queue_level_t;
+
+/// Priority queue struct. Levels are ring regions of one file with a combined header, level 0 is the highest
+typedef struct {
+    char fn[SPIFFS_FILE_NAME_MAX_SIZE]; ///< Path to store the queue data in SPIFFS. Mandatory prefix "/spiffs/"
+    uint8_t levels_count;           ///< Priority levels count, up to SPIFFS_CIRCULAR_QUEUE_PRIO_MAX_LEVELS
+    circular_queue_flags_t flags;   ///< Flags for queue type
+    circular_queue_level_t levels[SPIFFS_CIRCULAR_QUEUE_PRIO_MAX_LEVELS]; ///< Priority levels
+    uint32_t nonempty;              ///< Non-empty levels bitmap, bit n for level n. RAM only
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    SemaphoreHandle_t mutex;        ///< Held during every operation
+#endif
+} circular_queue_prio_t;
+#endif
+
 /**
  *	Macro that resembles foreach loop behaviour. Pops out the last queue elem
  *  each loop cycle until the queue is empty.
@@ -83,6 +411,16 @@ extern "C" {
  *  function will not be called.
  *  Initialization will result in failure only on null cq struct pointer, failure to mount SPIFFS, or failure
  *  to write queue data file on SPIFFS.
+ *  When SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE is enabled the queue locks are created here, so the cq struct must
+ *  be zero-initialized before the first init call (i.e. a global or declared with = {}).
+ *  With SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST or SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER enabled the queue is added
+ *  to the registry of initialized queues, so init also fails when SPIFFS_CIRCULAR_QUEUE_REGISTRY_SIZE queues
+ *  are already initialized. The cq struct must keep its address until spiffs_circular_queue_free.
+ *  With SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN enabled an existing file is not trusted blindly: the elems between
+ *  front and back indices are walked and the header is cut down to the last consistent elem, i.e. after a crash
+ *  or a truncated file.
+ *  With SPIFFS_CIRCULAR_QUEUE_INIT_PROFILE enabled the duration of the mount, file lookup, open and header
+ *  phases is kept in cq->init_profile, i.e. to measure wake-up cost.
  *
  *	@param[in] cq 	        Pointer to the circular_queue_t struct
  *
@@ -114,6 +452,51 @@ uint8_t spiffs_circular_queue_front(const circular_queue_t *cq, void *elem = NUL
  */
 uint8_t spiffs_circular_queue_enqueue(circular_queue_t *cq, const void *elem = NULL, const uint16_t elem_size = 0);
 
+/**
+ *	Enqueues one elem gathered from iovcnt fragments, i.e. a protocol header, payload and trailer kept in
+ *  separate buffers. The fragments are written straight to the queue file, wrapping over its end where needed,
+ *  and the header is persisted once, as for spiffs_circular_queue_enqueue.
+ *
+ *  The fragments total is the elem size. For fixed elem size queues it must be equal to the queue elem size.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] iov 			Array of elem fragments, in elem order. Empty fragments are skipped
+ *	@param[in] iovcnt 		Fragments count
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_enqueuev(circular_queue_t *cq, const circular_queue_iovec_t *iov, const uint8_t iovcnt);
+
+/**
+ *	Enqueues an elem serialized in place by writer_cb, without a scratch buffer. Room for max_len bytes is
+ *  checked first, then writer_cb streams the elem through spiffs_circular_queue_writer_put to the queue file.
+ *  The elem size is the bytes written, its size prefix is completed afterwards and the header persisted once.
+ *
+ *  Producers of the queue are blocked while writer_cb runs. For fixed elem size queues max_len is don't care,
+ *  writer_cb must write exactly the queue elem size.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] max_len 		Max elem size writer_cb may write
+ *	@param[in] writer_cb 	Serialization callback
+ *	@param[in] ctx 			User context passed to writer_cb
+ *
+ *	@return					1 on success and 0 on fail, no room or writer_cb dropping the elem
+ */
+uint8_t spiffs_circular_queue_enqueue_with(circular_queue_t *cq, const uint16_t max_len, 
+                                           circular_queue_writer_cb_t writer_cb, void *ctx = NULL);
+
+/**
+ *	Appends size bytes of data to the elem being written by a spiffs_circular_queue_enqueue_with callback.
+ *  A failed write, or one past max_len, drops the whole elem.
+ *
+ *	@param[in] writer 		Elem writer given to the callback
+ *	@param[in] data 		Pointer to the data to append
+ *	@param[in] size 		Data size in bytes
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_writer_put(circular_queue_writer_t *writer, const void *data, const uint16_t size);
+
 /**
  *	Pops out the first elem of the queue. When elem and elem_size are valid pointers, front elem is placed in them and then it pops out.
  *
@@ -125,6 +508,55 @@ uint8_t spiffs_circular_queue_enqueue(circular_queue_t *cq, const void *elem = N
  */
 uint8_t spiffs_circular_queue_dequeue(circular_queue_t *cq, void *elem = NULL, uint16_t *elem_size = NULL);
 
+/**
+ *	Hands up to max_elems elems from the front to cb without copying them out, i.e. to write them to a socket.
+ *  The queue data is read ahead in SPIFFS_CIRCULAR_QUEUE_CONSUME_BUFFER_SIZE chunks on the caller's stack and
+ *  every elem is passed as one contiguous slice of the read buffer. An elem split over the file end is joined
+ *  in the buffer by two reads, so it is a copy as well. The elems accepted by cb are dequeued with one header
+ *  persist.
+ *
+ *  An elem larger than SPIFFS_CIRCULAR_QUEUE_CONSUME_BUFFER_SIZE doesn't fit the read buffer, it is read on its
+ *  own into a heap buffer of its size, freed once cb returns. Consume stops there if the allocation fails.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] max_elems 	Max elems to consume
+ *	@param[in] cb 			Elem callback
+ *	@param[in] ctx 			User context passed to cb
+ *
+ *	@return					Elems consumed
+ */
+uint16_t spiffs_circular_queue_consume(circular_queue_t *cq, const uint16_t max_elems, circular_queue_consume_cb_t cb, 
+                                       void *ctx = NULL);
+
+/**
+ *	Packs as many whole front elems as fit in mtu bytes into buf with one sequential read, i.e. for a network
+ *  frame. Elems of variable elem size queues are framed with their 2 bytes little-endian size prefix, as stored
+ *  in the queue, fixed size elems are packed back to back. The elems stay in the queue until
+ *  spiffs_circular_queue_frame_commit, i.e. once the frame is acked, a frame not committed is read again.
+ *
+ *  An elem larger than mtu at the queue front gives no frame, dequeue it instead.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[out] buf 		Frame buffer of mtu bytes
+ *	@param[in] mtu 			Max frame size in bytes
+ *	@param[out] frame 		Frame size, elems count and position, to commit the frame
+ *
+ *	@return					1 if a frame with at least one elem was read and 0 otherwise
+ */
+uint8_t spiffs_circular_queue_dequeue_frame(circular_queue_t *cq, void *buf, const uint32_t mtu, circular_queue_frame_t *frame);
+
+/**
+ *	Dequeues the elems of a frame read by spiffs_circular_queue_dequeue_frame with one header persist.
+ *  It fails if the queue front moved since the frame was read, i.e. its elems were dequeued meanwhile,
+ *  even if the front came round to the same index.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] frame 		Frame to commit
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_frame_commit(circular_queue_t *cq, const circular_queue_frame_t *frame);
+
 /**
  *	Checks whether the queue is empty or not.
  *
@@ -197,8 +629,49 @@ uint16_t spiffs_circular_queue_get_count(const circular_queue_t *cq);
  */
 uint32_t spiffs_circular_queue_get_file_size(const circular_queue_t *cq);
 
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+/**
+ *	Returns the duration of the recovery scan run by the last init. 0 if the queue file was just created.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *
+ *	@return					Recovery scan duration in microseconds
+ */
+uint32_t spiffs_circular_queue_get_recovery_time(const circular_queue_t *cq);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_IDLE_GC
+/**
+ *	Runs SPIFFS garbage collection ahead of time, i.e. from the idle loop, so the next queue writes don't pay
+ *  for it. Frees room for the next SPIFFS_CIRCULAR_QUEUE_GC_WRITES elems, estimated from the fixed elem size
+ *  or the average stored elem, capped by the queue available space. Works in SPIFFS_CIRCULAR_QUEUE_GC_STEP
+ *  steps and doesn't start a new one once budget_ms is spent. The budget is soft: a step can't be
+ *  interrupted, so the call may overrun it by up to one step.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] budget_ms 	Time budget in milliseconds
+ *
+ *	@return					1 when the room is ready and 0 if the budget ran out or SPIFFS can't free that much
+ */
+uint8_t spiffs_circular_queue_maintain(const circular_queue_t *cq, const uint32_t budget_ms);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
 /**
- *	Frees resourses allocated for the queue and closes the SPIFFS.
+ *	Returns the bytes that still may be committed to queue files before the partition usage reaches
+ *  SPIFFS_CIRCULAR_QUEUE_HIGH_WATER_PCT, counting every initialized queue as if it was full.
+ *
+ *  Init creates a new queue file only if its full size fits the headroom, existing files are always opened.
+ *  An enqueue that grows its queue file is refused when the partition usage would cross the high-water mark,
+ *  i.e. because of other files. Container and priority queue files are preallocated, they count as used space.
+ *
+ *	@return					Headroom in bytes, 0 if the partition info is not available
+ */
+uint32_t spiffs_circular_queue_get_headroom(void);
+#endif
+
+/**
+ *	Frees resourses allocated for the queue, removes it from the registry and closes the SPIFFS.
  *
  *	@param[in] cq 			    Pointer to the circular_queue_t struct
  *	@param[in] unmount_spiffs   Unmount SPIFFS on free flag
@@ -207,6 +680,536 @@ uint32_t spiffs_circular_queue_get_file_size(const circular_queue_t *cq);
  */
 uint8_t	spiffs_circular_queue_free(circular_queue_t *cq, const uint8_t unmount_spiffs = 1);
 
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+/**
+ *	Registers fill level watermark callbacks, replacing the previous ones. The level is evaluated on every
+ *  enqueue and dequeue from the indices and count in RAM, no I/O is added. cb is called with
+ *  CIRCULAR_QUEUE_WATERMARK_HIGH when the level rises to high and with CIRCULAR_QUEUE_WATERMARK_LOW when it
+ *  falls back to low, each one once per crossing. If the level is at high already, cb is called right away.
+ *  Must be called after a successful spiffs_circular_queue_init.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] high 		High watermark
+ *	@param[in] low 		    Low watermark, below high
+ *	@param[in] unit 		Watermarks unit, bytes or elems
+ *	@param[in] cb 			Callback, NULL to unregister
+ *	@param[in] ctx 			User context passed to cb
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_set_watermarks(circular_queue_t *cq, const uint32_t high, const uint32_t low, 
+                                             const circular_queue_watermark_unit_t unit, 
+                                             circular_queue_watermark_cb_t cb, void *ctx = NULL);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+#define CIRCULAR_QUEUE_WAIT_FOREVER               (0xFFFFFFFFu) ///< Waiting calls timeout that never expires
+
+/**
+ *	Dequeues the front elem like spiffs_circular_queue_dequeue, waiting for an elem to arrive when the queue
+ *  is empty. The caller blocks on the queue events, it is woken up by enqueues from any task, the RAM front-end
+ *  flush and the async I/O worker included.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *	@param[out] elem_size 	Dequeued elem size
+ *	@param[in] timeout_ms 	Max waiting time in milliseconds, CIRCULAR_QUEUE_WAIT_FOREVER or beyond the tick counter range to wait without limit
+ *
+ *	@return					1 on success and 0 on timeout or fail
+ */
+uint8_t spiffs_circular_queue_dequeue_wait(circular_queue_t *cq, void *elem, uint16_t *elem_size, const uint32_t timeout_ms);
+
+/**
+ *	Enqueues elem like spiffs_circular_queue_enqueue, waiting for dequeues to free enough space when the queue
+ *  is full. An elem that doesn't fit the queue even when empty fails at once.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size. Don't care for fixed elem size queues
+ *	@param[in] timeout_ms 	Max waiting time in milliseconds, CIRCULAR_QUEUE_WAIT_FOREVER or beyond the tick counter range to wait without limit
+ *
+ *	@return					1 on success and 0 on timeout or fail
+ */
+uint8_t spiffs_circular_queue_enqueue_wait(circular_queue_t *cq, const void *elem, const uint16_t elem_size, 
+                                           const uint32_t timeout_ms);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+/**
+ *	Starts a RAM front-end for the queue: a lock-free single-producer/single-consumer ring of ram_size bytes
+ *  and a flush task pinned to SPIFFS_CIRCULAR_QUEUE_FLUSH_TASK_CORE that drains it into the queue file.
+ *
+ *  Must be called after a successful spiffs_circular_queue_init. The cq struct must keep its address
+ *  while the front-end runs. It is stopped by spiffs_circular_queue_free.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] ram_size 	RAM ring size in bytes. Each elem takes its size plus 2 bytes
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_frontend_init(circular_queue_t *cq, const uint32_t ram_size);
+
+/**
+ *	Enqueues elem of elem_size size into the RAM front-end. Never touches the flash: it is a memcpy plus
+ *  an atomic store, then the flush task is notified. Elems become visible to front/dequeue once flushed.
+ *
+ *  Only one task may call it for a given queue at a time (single producer).
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size. Don't care for fixed elem size queues
+ *
+ *	@return					1 on success and 0 if the RAM ring is full or not started
+ */
+uint8_t spiffs_circular_queue_enqueue_buffered(circular_queue_t *cq, const void *elem, const uint16_t elem_size = 0);
+
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+/**
+ *	Pre-allocates SPIFFS_CIRCULAR_QUEUE_ISR_SLOTS staging slots in internal RAM for enqueuing from ISRs.
+ *
+ *  Must be called after a successful spiffs_circular_queue_init. They are released by spiffs_circular_queue_free.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_staging_init(circular_queue_t *cq);
+
+/**
+ *	Copies elem of elem_size size into a free staging slot and returns. Lock-free, no heap, no file I/O and
+ *  no blocking, so it is safe to call from any ISR or task, on any core, concurrently.
+ *  Staged elems reach the queue file on spiffs_circular_queue_flush or with the front-end flush task.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size, up to SPIFFS_CIRCULAR_QUEUE_ISR_SLOT_SIZE. Don't care for fixed elem size queues
+ *
+ *	@return					1 on success and 0 if all slots are taken or not started
+ */
+uint8_t spiffs_circular_queue_enqueue_from_isr(circular_queue_t *cq, const void *elem, const uint16_t elem_size = 0);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+/**
+ *	Queues an enqueue of elem of elem_size size to the I/O worker task and returns without touching the flash.
+ *
+ *  The worker runs operations of all queues in issue order. Adjacent enqueues to the same queue are merged
+ *  into one batch with a single file open and header persist. elem must stay valid until cb is called.
+ *  The worker task is started on the first async call.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size. Don't care for fixed elem size queues
+ *	@param[in] cb 			Completion callback, may be NULL
+ *	@param[in] ctx 			User context passed to cb
+ *
+ *	@return					1 if the operation was queued and 0 on fail
+ */
+uint8_t spiffs_circular_queue_enqueue_async(circular_queue_t *cq, const void *elem, const uint16_t elem_size, 
+                                            circular_queue_async_cb_t cb, void *ctx = NULL);
+
+/**
+ *	Queues a dequeue to the I/O worker task and returns without touching the flash. The front elem is placed
+ *  in elem and its size is passed to cb. Adjacent dequeues from the same queue are merged into one batch.
+ *  elem must stay valid until cb is called.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *	@param[in] cb 			Completion callback, may be NULL
+ *	@param[in] ctx 			User context passed to cb
+ *
+ *	@return					1 if the operation was queued and 0 on fail
+ */
+uint8_t spiffs_circular_queue_dequeue_async(circular_queue_t *cq, void *elem, circular_queue_async_cb_t cb, void *ctx = NULL);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND || SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+/**
+ *	Moves all elems buffered in RAM (front-end ring and ISR staging slots) to the queue file in the caller's
+ *  context, i.e. before going to sleep. Elems that don't fit in the queue remain buffered.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *
+ *	@return					1 when nothing is left in RAM and 0 otherwise
+ */
+uint8_t spiffs_circular_queue_flush(circular_queue_t *cq);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+/**
+ *	Switches the queue to deferred persist mode and back. In deferred mode enqueue and dequeue keep the header
+ *  changes in RAM, only the elem data is written, and the header reaches the flash on spiffs_circular_queue_sync
+ *  or spiffs_circular_queue_sync_all. A reset in between loses the elems enqueued and brings back the elems
+ *  dequeued since the last sync. Space freed by dequeues is not overwritten before the header is persisted, an
+ *  enqueue that needs it persists the header first. Leaving deferred mode syncs the queue.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] enable 		1 to defer header persists, 0 to persist on every operation
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_defer_persist(circular_queue_t *cq, const uint8_t enable);
+
+/**
+ *	Persists the queue header if it changed since the last persist.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *
+ *	@return					1 on success or nothing to persist and 0 on fail
+ */
+uint8_t spiffs_circular_queue_sync(circular_queue_t *cq);
+
+/**
+ *	Persists the changed headers of all initialized queues in one pass, i.e. right before deep sleep or from
+ *  a periodic task. Queues must not be freed while it runs.
+ *
+ *	@return					1 when all queues are synced and 0 if any failed
+ */
+uint8_t spiffs_circular_queue_sync_all(void);
+
+/**
+ *	Enqueues elem of elem_size size with the given durability, whatever the queue persist mode is.
+ *
+ *  NONE goes through the RAM front-end when it is started, under the same single producer rule as
+ *  spiffs_circular_queue_enqueue_buffered. DATA syncs the elem data and leaves the header to the next sync or
+ *  FULL enqueue, so the elem survives a reset only after them. FULL syncs the data and the header, covering all
+ *  elems enqueued before. DATA and FULL move RAM buffered elems to the file first to keep the queue order.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size. Don't care for fixed elem size queues
+ *	@param[in] durability 	Durability level
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_enqueue_durable(circular_queue_t *cq, const void *elem, const uint16_t elem_size, 
+                                              const circular_queue_durability_t durability);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+#define CIRCULAR_QUEUE_FAULT_NOT_TORN             (0xFFFFFFFFu) ///< Last write before the cut is issued whole
+
+/**
+ *	Arms a simulated power cut. Medium writes of all queues are counted from now on, write number cut_after
+ *  is the last one and only its first torn_size bytes are issued. All following writes and syncs fail as if
+ *  the power was gone, until disarmed.
+ *
+ *  The flash is modeled page by page: the file system programs a page once the writes move on to another
+ *  page or the file is synced. The page written at the cut keeps its last programmed content, so data not
+ *  synced in it is lost, torn writes included. Only the page of the last written file is tracked.
+ *  Not thread safe, meant for single task crash tests: arm, run a workload, disarm and re-init the queues.
+ *  Unarmed, medium writes go straight to the file system.
+ *
+ *	@param[in] cut_after 	Writes allowed before the cut, UINT32_MAX to only count writes
+ *	@param[in] torn_size 	Bytes issued of the last write, CIRCULAR_QUEUE_FAULT_NOT_TORN if all
+ *	@param[in] page_size 	Flash page size in bytes
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_fault_arm(const uint32_t cut_after, const uint32_t torn_size = CIRCULAR_QUEUE_FAULT_NOT_TORN,
+                                        const uint16_t page_size = SPIFFS_CIRCULAR_QUEUE_FAULT_PAGE_SIZE);
+
+/**
+ *	Brings the power back, medium writes succeed again.
+ *
+ *	@return					Medium writes counted since armed, up to the cut
+ */
+uint32_t spiffs_circular_queue_fault_disarm(void);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+/**
+ *	Opens the cursor named name, registering it if there is none. A new cursor starts at the queue front.
+ *
+ *  While cursors are registered, elems are reclaimed only once all cursors have read them. The plain dequeue
+ *  still drops the front elem for every cursor. Only queue files created by init with a non-zero use_cursors
+ *  hold cursors, the others keep the plain header. The cursors table is written on header persists only
+ *  while a cursor is registered.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] name 		Cursor name, up to SPIFFS_CIRCULAR_QUEUE_CURSOR_NAME_SIZE - 1 chars
+ *	@param[out] cursor_id 	Pointer to the cursor id for the cursor calls
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_cursor_open(circular_queue_t *cq, const char *name, uint8_t *cursor_id);
+
+/**
+ *	Unregisters a cursor. Elems only it was holding back are reclaimed.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] cursor_id 	Cursor id
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_cursor_close(circular_queue_t *cq, const uint8_t cursor_id);
+
+/**
+ *	Reads the next elem for the cursor and advances only that cursor. The elem space is reclaimed when the
+ *  slowest cursor passes it.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] cursor_id 	Cursor id
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *  @param[out] elem_size   Pointer to a queue elem size. Don't care for fixed elem size queues
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_dequeue_for(circular_queue_t *cq, const uint8_t cursor_id, void *elem, uint16_t *elem_size = NULL);
+
+/**
+ *	Returns the count of elems the cursor hasn't read yet.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] cursor_id 	Cursor id
+ *
+ *	@return					Elems left for the cursor, 0 for a wrong cursor_id
+ */
+uint16_t spiffs_circular_queue_get_count_for(const circular_queue_t *cq, const uint8_t cursor_id);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+/**
+ *	Adds an elem to the block being filled. A full block is written first as one queue elem with one header
+ *  persist, headed by its elems count and CRC. Elems in the block being filled are only kept in RAM and
+ *  are lost on a reset or deep sleep, call spiffs_circular_queue_block_flush before.
+ *
+ *  Block format queues are created by init with a non-zero block_size, variable elem size only. The plain
+ *  calls see a block as one elem, don't mix them with the block calls for writing.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[in] elem 		Pointer to the elem data
+ *	@param[in] elem_size 	Elem size, up to the block size less the block header and elem size prefix
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_block_enqueue(circular_queue_t *cq, const void *elem, const uint16_t elem_size);
+
+/**
+ *	Writes the block being filled, if it holds any elem. Required before a reset or deep sleep,
+ *  the block being filled is not on the flash until then.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_block_flush(circular_queue_t *cq);
+
+/**
+ *	Reads and dequeues the front block as a unit. A block failing its CRC check is dropped, the call fails
+ *  and cq->dropped is incremented, so a failed call with a non-empty queue before it tells corruption.
+ *
+ *	@param[in] cq 			Pointer to the circular_queue_t struct
+ *	@param[out] buf 		Block buffer, of the queue block size at least
+ *	@param[in] buf_size 	Block buffer size
+ *	@param[out] block 		Block to walk with spiffs_circular_queue_block_next, valid while buf is
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_block_dequeue(circular_queue_t *cq, void *buf, const uint16_t buf_size, 
+                                            circular_queue_block_t *block);
+
+/**
+ *	Gets the next elem of a dequeued block.
+ *
+ *	@param[in] block 		Block from spiffs_circular_queue_block_dequeue
+ *	@param[out] elem 		Pointer to the elem data, points into the block buffer
+ *	@param[out] elem_size 	Elem size
+ *
+ *	@return					1 on success and 0 past the last elem
+ */
+uint8_t spiffs_circular_queue_block_next(circular_queue_block_t *block, const void **elem, uint16_t *elem_size);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+/**
+ *	Initializes a container of several logical queues in one SPIFFS file, creating or reading it.
+ *
+ *  fn, queues_count, block_size and blocks_count must be set before. Queues take data blocks from the shared
+ *  area as they grow and give them back as they are dequeued, so no queue has a fixed share of the space.
+ *  An existing file is reused only if it was created with the same geometry. The mq struct must be
+ *  zero-initialized before the first init call.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_init(circular_queue_multi_t *mq);
+
+/**
+ *	Enqueues elem of elem_size size to the queue_id logical queue. The elem may span several blocks.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *	@param[in] queue_id 	Logical queue index, less than queues_count
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_enqueue(circular_queue_multi_t *mq, const uint8_t queue_id, 
+                                            const void *elem, const uint16_t elem_size);
+
+/**
+ *	Dequeues the front elem of the queue_id logical queue. Emptied blocks go back to the shared area.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *	@param[in] queue_id 	Logical queue index, less than queues_count
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *  @param[out] elem_size   Pointer to a queue elem size
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_dequeue(circular_queue_multi_t *mq, const uint8_t queue_id, 
+                                            void *elem, uint16_t *elem_size);
+
+/**
+ *	Gets the front elem of the queue_id logical queue without removing it.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *	@param[in] queue_id 	Logical queue index, less than queues_count
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *  @param[out] elem_size   Pointer to a queue elem size
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_front(circular_queue_multi_t *mq, const uint8_t queue_id, 
+                                          void *elem, uint16_t *elem_size);
+
+/**
+ *	Returns the queue_id logical queue nodes count.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *	@param[in] queue_id 	Logical queue index, less than queues_count
+ *
+ *	@return					Queue nodes count, 0 for a wrong queue_id
+ */
+uint16_t spiffs_circular_queue_multi_get_count(circular_queue_multi_t *mq, const uint8_t queue_id);
+
+/**
+ *	Returns the container free space shared by all its queues, in free blocks. Each elem takes its size plus 2 bytes.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *
+ *	@return					Free bytes in the data area
+ */
+uint32_t spiffs_circular_queue_multi_available_space(circular_queue_multi_t *mq);
+
+/**
+ *	Starts a batch of operations, on any of the container queues, that share one file handle and one header
+ *  persist on spiffs_circular_queue_multi_batch_end. Other tasks block on the container until the batch ends.
+ *  Batches may nest, only the outermost end persists.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_batch_begin(circular_queue_multi_t *mq);
+
+/**
+ *	Ends a batch started with spiffs_circular_queue_multi_batch_begin, persisting the header once.
+ *
+ *	@param[in] mq 			Pointer to the circular_queue_multi_t struct
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_batch_end(circular_queue_multi_t *mq);
+
+/**
+ *	Frees resources allocated for the container, removes its file and closes the SPIFFS.
+ *
+ *	@param[in] mq 			    Pointer to the circular_queue_multi_t struct
+ *	@param[in] unmount_spiffs   Unmount SPIFFS on free flag
+ *
+ *	@return					    1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_multi_free(circular_queue_multi_t *mq, const uint8_t unmount_spiffs = 1);
+#endif
+
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+/**
+ *	Initializes a priority queue of several levels in one SPIFFS file, creating or reading it.
+ *
+ *  fn and levels_count must be set before, and each level max_size optionally. Every level is a ring region
+ *  of its own, so low priority elems can't take the space of higher ones. An existing file is reused only
+ *  if it has the same levels. The pq struct must be zero-initialized before the first init call.
+ *
+ *	@param[in] pq 			Pointer to the circular_queue_prio_t struct
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_prio_init(circular_queue_prio_t *pq);
+
+/**
+ *	Enqueues elem of elem_size size to the given priority level.
+ *
+ *	@param[in] pq 			Pointer to the circular_queue_prio_t struct
+ *	@param[in] level 	    Priority level, 0 is the highest
+ *	@param[in] elem 		Pointer to a queue elem buffer
+ *  @param[in] elem_size    A queue elem size
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_prio_enqueue(circular_queue_prio_t *pq, const uint8_t level, 
+                                           const void *elem, const uint16_t elem_size);
+
+/**
+ *	Dequeues the front elem of the highest priority non-empty level, with one header persist.
+ *
+ *	@param[in] pq 			Pointer to the circular_queue_prio_t struct
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *  @param[out] elem_size   Pointer to a queue elem size
+ *  @param[out] level       Pointer to the elem priority level, may be NULL
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_prio_dequeue(circular_queue_prio_t *pq, void *elem, uint16_t *elem_size, 
+                                           uint8_t *level = NULL);
+
+/**
+ *	Gets the elem spiffs_circular_queue_prio_dequeue would return, without removing it.
+ *
+ *	@param[in] pq 			Pointer to the circular_queue_prio_t struct
+ *	@param[out] elem 		Pointer to a queue elem buffer
+ *  @param[out] elem_size   Pointer to a queue elem size
+ *  @param[out] level       Pointer to the elem priority level, may be NULL
+ *
+ *	@return					1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_prio_front(circular_queue_prio_t *pq, void *elem, uint16_t *elem_size, 
+                                         uint8_t *level = NULL);
+
+/**
+ *	Returns the non-empty levels bitmap, bit n set if level n holds elems. Reads RAM only.
+ *
+ *	@param[in] pq 			Pointer to the circular_queue_prio_t struct
+ *
+ *	@return					Non-empty levels bitmap, 0 if the queue is empty
+ */
+uint32_t spiffs_circular_queue_prio_nonempty(const circular_queue_prio_t *pq);
+
+/**
+ *	Returns the given priority level nodes count.
+ *
+ *	@param[in] pq 			Pointer to the circular_queue_prio_t struct
+ *	@param[in] level 	    Priority level
+ *
+ *	@return					Level nodes count, 0 for a wrong level
+ */
+uint16_t spiffs_circular_queue_prio_get_count(const circular_queue_prio_t *pq, const uint8_t level);
+
+/**
+ *	Frees resources allocated for the priority queue, removes its file and closes the SPIFFS.
+ *
+ *	@param[in] pq 			    Pointer to the circular_queue_prio_t struct
+ *	@param[in] unmount_spiffs   Unmount SPIFFS on free flag
+ *
+ *	@return					    1 on success and 0 on fail
+ */
+uint8_t spiffs_circular_queue_prio_free(circular_queue_prio_t *pq, const uint8_t unmount_spiffs = 1);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
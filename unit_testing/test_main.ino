@@ -8,6 +8,9 @@
 
 #include "spiffs_circular_queue/src/spiffs_circular_queue.h"
 
+#include <deque>
+#include <vector>
+
 /*
  *  Test cases:
  *      I) Variable size queue
@@ -29,7 +32,31 @@
  *          12) [done] get_count function
  *          13) [done] front function
  *          14) [done] is_empty function
- *          15) 
+ *          15) [done] Concurrent producer and consumer tasks (SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE)
+ *              (a) [done] Headers persisted from two handles, re-init reads the last one
+ *          16) [done] RAM front-end buffered enqueue and background flush (SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND)
+ *          17) [done] Concurrent enqueue from ISR into staging slots and flush (SPIFFS_CIRCULAR_QUEUE_ISR_STAGING)
+ *          18) [done] Async enqueue and dequeue with completion callbacks (SPIFFS_CIRCULAR_QUEUE_ASYNC)
+ *          19) [done] More queues than pooled file handles, interleaved operations (SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE)
+ *              (a) [done] Queue struct re-pointed to another file, re-init reads the new one
+ *          20) [done] Logical queues sharing one container file (SPIFFS_CIRCULAR_QUEUE_MULTI)
+ *          21) [done] Priority queue levels order and isolation (SPIFFS_CIRCULAR_QUEUE_PRIO)
+ *          22) [done] Independent consumer cursors over one queue, opt-in per queue (SPIFFS_CIRCULAR_QUEUE_CURSORS)
+ *          23) [done] Recovery scan of a stale header on init, full queues of growing size kept intact (SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN)
+ *          24) [done] Deferred headers persisted by sync_all, freed space reuse (SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST)
+ *          25) [done] Enqueue durability levels and order across them (SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST)
+ *          26) [done] Power cut at every write of a workload, whole and torn, unsynced pages lost (SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION)
+ *          27) [done] Random operations checked against a deque model, ops per second
+ *          28) [done] SPIFFS garbage collection on idle maintenance calls (SPIFFS_CIRCULAR_QUEUE_IDLE_GC)
+ *          29) [done] Partition headroom under the high-water mark, new queues admission (SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER)
+ *          30) [done] Blocking enqueue/dequeue producer and consumer, timeouts (SPIFFS_CIRCULAR_QUEUE_WAIT)
+ *          31) [done] High/low watermark callbacks in elems and bytes, hysteresis, other queue used from the callback (SPIFFS_CIRCULAR_QUEUE_WATERMARKS)
+ *          32) [done] Scatter-gather enqueue of fragments split over the file end
+ *          33) [done] In-place serialization on enqueue, dropped and oversized elems
+ *          34) [done] Zero-copy consume in batches, stop by callback, elems split over the file end, oversize elems
+ *          35) [done] MTU frames of whole elems, commit after ack, resend and stale commit, also after a wrap
+ *          36) [done] Block format round trip, CRC checked on dequeue and on init (SPIFFS_CIRCULAR_QUEUE_BLOCKS)
+ *          37) 
  *          ...
  *          n-4) dequeue to empty implicitly done many times in present test cases
  *          n-3) enqueue and dequeue functions are implicitly tested
@@ -55,6 +82,30 @@
  *          12) [done] get_count function
  *          13) [done] front function
  *          14) [done] is_empty function
+ *          15) [done] Concurrent producer and consumer tasks (SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE)
+ *              (a) [done] Headers persisted from two handles, re-init reads the last one
+ *          16) [done] RAM front-end buffered enqueue and background flush (SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND)
+ *          17) [done] Concurrent enqueue from ISR into staging slots and flush (SPIFFS_CIRCULAR_QUEUE_ISR_STAGING)
+ *          18) [done] Async enqueue and dequeue with completion callbacks (SPIFFS_CIRCULAR_QUEUE_ASYNC)
+ *          19) [done] More queues than pooled file handles, interleaved operations (SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE)
+ *              (a) [done] Queue struct re-pointed to another file, re-init reads the new one
+ *          20) [done] Logical queues sharing one container file (SPIFFS_CIRCULAR_QUEUE_MULTI)
+ *          21) [done] Priority queue levels order and isolation (SPIFFS_CIRCULAR_QUEUE_PRIO)
+ *          22) [done] Independent consumer cursors over one queue, opt-in per queue (SPIFFS_CIRCULAR_QUEUE_CURSORS)
+ *          23) [done] Recovery scan of a stale header on init, full queues of growing size kept intact (SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN)
+ *          24) [done] Deferred headers persisted by sync_all, freed space reuse (SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST)
+ *          25) [done] Enqueue durability levels and order across them (SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST)
+ *          26) [done] Power cut at every write of a workload, whole and torn, unsynced pages lost (SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION)
+ *          27) [done] Random operations checked against a deque model, ops per second
+ *          28) [done] SPIFFS garbage collection on idle maintenance calls (SPIFFS_CIRCULAR_QUEUE_IDLE_GC)
+ *          29) [done] Partition headroom under the high-water mark, new queues admission (SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER)
+ *          30) [done] Blocking enqueue/dequeue producer and consumer, timeouts (SPIFFS_CIRCULAR_QUEUE_WAIT)
+ *          31) [done] High/low watermark callbacks in elems and bytes, hysteresis, other queue used from the callback (SPIFFS_CIRCULAR_QUEUE_WATERMARKS)
+ *          32) [done] Scatter-gather enqueue of fragments split over the file end
+ *          33) [done] In-place serialization on enqueue, dropped and oversized elems
+ *          34) [done] Zero-copy consume in batches, stop by callback, elems split over the file end, oversize elems
+ *          35) [done] MTU frames of whole elems, commit after ack, resend and stale commit, also after a wrap
+ *          36) [done] Block format round trip, CRC checked on dequeue and on init (SPIFFS_CIRCULAR_QUEUE_BLOCKS)
  * 
  *  Each test case must be tested on every medium (SPIFFS, EEPROM, RAM)
 */
@@ -432,7 +483,7 @@ void spiffs_full_queue_variable(void) {
 }
 
 void spiffs_make_two_queues_variable(void) {
-    circular_queue_t cq1;
+    circular_queue_t cq1 = {};
     snprintf(cq1.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/test1");
     cq.max_size = 1024;
     assert_equal(spiffs_circular_queue_init(&cq1), 1, "SPIFFS Make Two Queues. Just checking for two independent queues coexistance.");
@@ -662,7 +713,7 @@ void spiffs_full_queue_fixed(void) {
 }
 
 void spiffs_make_two_queues_fixed(void) {
-    circular_queue_t cq1;
+    circular_queue_t cq1 = {};
     cq1.max_size = 512;
     cq1.elem_size = 0;
     snprintf(cq1.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/test1");
@@ -671,6 +722,1568 @@ void spiffs_make_two_queues_fixed(void) {
     cq1.free(&cq1, 0); // set zero to unmount on tear_down
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium concurrent access test cases ///////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+#define CONCURRENT_ELEMS_COUNT          1000
+
+typedef struct {
+    uint32_t sum;
+    uint32_t errors;
+    SemaphoreHandle_t done;
+} concurrent_test_ctx_t;
+
+// enqueues CONCURRENT_ELEMS_COUNT elems retrying on a full queue
+void _concurrent_producer_task(void *arg) {
+    concurrent_test_ctx_t *ctx = (concurrent_test_ctx_t *)arg;
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE +1];
+
+    for (uint32_t n = 0; n < CONCURRENT_ELEMS_COUNT; n++) {
+        uint16_t buf_size = n % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1;
+
+        if (test_type == TEST_TYPE_FIXED_ELEM_SIZE) {
+            memcpy(buf, &n, sizeof(n));
+        } else {
+            _makeseq(buf_size, buf, CIRCULAR_QUEUE_MAX_ELEM_SIZE+1);
+            buf[0] = n;
+        }
+
+        while (!cq.enqueue(&cq, buf, buf_size)) {
+            vTaskDelay(1);
+        }
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+// dequeues CONCURRENT_ELEMS_COUNT elems checking their order
+void _concurrent_consumer_task(void *arg) {
+    concurrent_test_ctx_t *ctx = (concurrent_test_ctx_t *)arg;
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE +1];
+    uint16_t buf_size = 0;
+
+    for (uint32_t n = 0; n < CONCURRENT_ELEMS_COUNT; n++) {
+        while (!cq.dequeue(&cq, buf, &buf_size)) {
+            vTaskDelay(1);
+        }
+
+        if (test_type == TEST_TYPE_FIXED_ELEM_SIZE) {
+            uint32_t elem;
+            memcpy(&elem, buf, sizeof(elem));
+            ctx->errors += elem != n;
+            ctx->sum += elem;
+        } else {
+            ctx->errors += buf[0] != (uint8_t)n || buf_size != n % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1;
+            for (uint16_t i = 1; i < buf_size; i++) {
+                ctx->sum += buf[i];
+            }
+        }
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+void spiffs_concurrent_producer_consumer(void) {
+    concurrent_test_ctx_t ctx = {0, 0, xSemaphoreCreateCounting(2, 0)};
+    uint32_t expc_sum = 0;
+
+    for (uint32_t n = 0; n < CONCURRENT_ELEMS_COUNT; n++) {
+        if (test_type == TEST_TYPE_FIXED_ELEM_SIZE) {
+            expc_sum += n;
+        } else {
+            expc_sum += (n % CIRCULAR_QUEUE_MAX_ELEM_SIZE) * (n % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1) / 2;
+        }
+    }
+
+    // producer and consumer on different cores to get real parallelism
+    xTaskCreatePinnedToCore(_concurrent_producer_task, "producer", 4096, &ctx, 1, NULL, 0);
+    xTaskCreatePinnedToCore(_concurrent_consumer_task, "consumer", 4096, &ctx, 1, NULL, 1);
+
+    xSemaphoreTake(ctx.done, portMAX_DELAY);
+    xSemaphoreTake(ctx.done, portMAX_DELAY);
+    vSemaphoreDelete(ctx.done);
+
+    assert_equal(1, !ctx.errors && expc_sum == ctx.sum && cq.is_empty(&cq), "SPIFFS Concurrent Producer Consumer. Producer and consumer tasks on different cores, order and checksum checked.");
+    printf("        Expected/Real (%d/%d), order errors %d\n", expc_sum, ctx.sum, ctx.errors);
+}
+
+#define PERSIST_ELEMS_COUNT             200
+
+// enqueues PERSIST_ELEMS_COUNT small elems retrying on a full queue
+void _persist_producer_task(void *arg) {
+    concurrent_test_ctx_t *ctx = (concurrent_test_ctx_t *)arg;
+    uint8_t buf[sizeof(uint32_t)*4];
+
+    for (uint32_t n = 0; n < PERSIST_ELEMS_COUNT; n++) {
+        memset(buf, n, sizeof(buf));
+        while (!cq.enqueue(&cq, buf, n % sizeof(buf) + 1)) {
+            vTaskDelay(1);
+        }
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+// dequeues half of the elems, the other half is left for the re-initialized queue
+void _persist_consumer_task(void *arg) {
+    concurrent_test_ctx_t *ctx = (concurrent_test_ctx_t *)arg;
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE];
+    uint16_t buf_size = 0;
+
+    for (uint32_t n = 0; n < PERSIST_ELEMS_COUNT/2; n++) {
+        while (!cq.dequeue(&cq, buf, &buf_size)) {
+            vTaskDelay(1);
+        }
+        ctx->errors += buf[0] != (uint8_t)n;
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+void spiffs_concurrent_persist_reinit(void) {
+    concurrent_test_ctx_t ctx = {0, 0, xSemaphoreCreateCounting(2, 0)};
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE];
+    uint16_t buf_size = 0;
+    uint32_t front_idx = 0, back_idx = 0;
+    uint16_t count = 0;
+
+    // producer and consumer persist the header from their own file handles
+    xTaskCreatePinnedToCore(_persist_producer_task, "producer", 4096, &ctx, 1, NULL, 0);
+    xTaskCreatePinnedToCore(_persist_consumer_task, "consumer", 4096, &ctx, 1, NULL, 1);
+
+    xSemaphoreTake(ctx.done, portMAX_DELAY);
+    xSemaphoreTake(ctx.done, portMAX_DELAY);
+    vSemaphoreDelete(ctx.done);
+
+    // the header on the flash must be the last one persisted, whichever handle wrote it
+    FILE *fd = fopen(cq.fn, "rb");
+    if (fd) {
+        ctx.errors += fread(&front_idx, 1, sizeof(front_idx), fd) != sizeof(front_idx);
+        ctx.errors += fread(&back_idx, 1, sizeof(back_idx), fd) != sizeof(back_idx);
+        ctx.errors += fread(&count, 1, sizeof(count), fd) != sizeof(count);
+        fclose(fd);
+    }
+    ctx.errors += !fd || front_idx != cq.front_idx || back_idx != cq.back_idx || count != cq.count;
+
+    ctx.errors += !spiffs_circular_queue_init(&cq) || cq.front_idx != front_idx || cq.back_idx != back_idx || 
+        cq.count != PERSIST_ELEMS_COUNT/2;
+    for (uint32_t n = PERSIST_ELEMS_COUNT/2; n < PERSIST_ELEMS_COUNT; n++) {
+        ctx.errors += !cq.dequeue(&cq, buf, &buf_size) || buf[0] != (uint8_t)n;
+    }
+    ctx.errors += !cq.is_empty(&cq);
+
+    assert_equal(1, !ctx.errors, "SPIFFS Concurrent Persist Re-init. Headers persisted from two handles, the last one is on the flash.");
+    printf("        Elems %d, errors %d\n", PERSIST_ELEMS_COUNT, ctx.errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium RAM front-end test cases ///////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+#define FRONTEND_RAM_SIZE               256
+#define FRONTEND_ELEMS_COUNT            60 // fits in both test queues
+
+void spiffs_frontend_enqueue_buffered(void) {
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE +1];
+    uint16_t buf_size = 0;
+    uint32_t expc_sum = 0;
+    uint32_t real_sum = 0;
+    uint32_t errors = 0;
+    uint32_t max_latency = 0;
+
+    spiffs_circular_queue_frontend_init(&cq, FRONTEND_RAM_SIZE);
+
+    for (uint32_t n = 0; n < FRONTEND_ELEMS_COUNT; n++) {
+        buf_size = n % (FRONTEND_ELEMS_COUNT/2) + 1;
+        if (test_type == TEST_TYPE_FIXED_ELEM_SIZE) {
+            memcpy(buf, &n, sizeof(n));
+            expc_sum += n;
+        } else {
+            _makeseq(buf_size, buf, CIRCULAR_QUEUE_MAX_ELEM_SIZE+1);
+            buf[0] = n;
+            expc_sum += (buf_size - 1) * buf_size / 2;
+        }
+
+        uint32_t t0 = micros();
+        // RAM ring is smaller than all elems, flush task has to drain it meanwhile
+        while (!spiffs_circular_queue_enqueue_buffered(&cq, buf, buf_size)) {
+            vTaskDelay(1);
+            t0 = micros();
+        }
+        if (micros() - t0 > max_latency) max_latency = micros() - t0;
+    }
+
+    // no explicit flush, wait for the flush task
+    for (uint16_t i = 0; i < 200 && cq.get_count(&cq) != FRONTEND_ELEMS_COUNT; i++) {
+        vTaskDelay(10);
+    }
+
+    for (uint32_t n = 0; cq.dequeue(&cq, buf, &buf_size); n++) {
+        if (test_type == TEST_TYPE_FIXED_ELEM_SIZE) {
+            uint32_t elem;
+            memcpy(&elem, buf, sizeof(elem));
+            errors += elem != n;
+            real_sum += elem;
+        } else {
+            errors += buf[0] != n || buf_size != n % (FRONTEND_ELEMS_COUNT/2) + 1;
+            for (uint16_t i = 1; i < buf_size; i++) {
+                real_sum += buf[i];
+            }
+        }
+    }
+
+    assert_equal(1, !errors && expc_sum == real_sum, "SPIFFS RAM Front-End. Buffered enqueue through a small RAM ring drained by the flush task, order and checksum checked.");
+    printf("        Expected/Real (%d/%d), order errors %d, max enqueue latency %d us\n", expc_sum, real_sum, errors, max_latency);
+}
+
+void spiffs_frontend_flush(void) {
+    uint32_t elem = 4223;
+    uint8_t ok = spiffs_circular_queue_frontend_init(&cq, FRONTEND_RAM_SIZE);
+
+    for (uint16_t n = 0; n < 10; n++) {
+        ok &= spiffs_circular_queue_enqueue_buffered(&cq, &elem, sizeof(elem));
+    }
+    ok &= spiffs_circular_queue_flush(&cq);
+
+    assert_equal(1, ok && cq.get_count(&cq) == 10, "SPIFFS RAM Front-End Flush. Buffered elems are in the queue right after flush.");
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium ISR staging test cases /////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+#define STAGING_ELEMS_COUNT             40 // per producer, fits in both test queues
+
+typedef struct {
+    uint8_t id;
+    SemaphoreHandle_t done;
+} staging_test_ctx_t;
+
+// stands for an ISR, enqueue_from_isr never blocks so a full staging is just retried
+void _staging_producer_task(void *arg) {
+    staging_test_ctx_t *ctx = (staging_test_ctx_t *)arg;
+    uint8_t buf[sizeof(uint32_t)];
+
+    for (uint8_t n = 0; n < STAGING_ELEMS_COUNT; n++) {
+        buf[0] = ctx->id;
+        buf[1] = n;
+        buf[2] = buf[3] = 0;
+        while (!spiffs_circular_queue_enqueue_from_isr(&cq, buf, sizeof(buf))) {
+            vTaskDelay(1);
+        }
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+void spiffs_staging_enqueue_from_isr(void) {
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(2, 0);
+    staging_test_ctx_t ctx[2] = {{0, done}, {1, done}};
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE +1];
+    uint16_t buf_size = 0;
+    uint8_t next[2] = {0, 0};
+    uint32_t errors = 0;
+
+    spiffs_circular_queue_staging_init(&cq);
+
+    // two producers racing for the same slots on different cores
+    xTaskCreatePinnedToCore(_staging_producer_task, "isr0", 2048, &ctx[0], 1, NULL, 0);
+    xTaskCreatePinnedToCore(_staging_producer_task, "isr1", 2048, &ctx[1], 1, NULL, 1);
+
+    for (uint8_t finished = 0; finished < 2; ) {
+        spiffs_circular_queue_flush(&cq);
+        finished += xSemaphoreTake(done, 1) == pdTRUE;
+    }
+    spiffs_circular_queue_flush(&cq);
+    vSemaphoreDelete(done);
+
+    // each producer's elems must come in its own order
+    while (cq.dequeue(&cq, buf, &buf_size)) {
+        errors += buf[0] > 1 || buf[1] != next[buf[0] & 1]++;
+    }
+
+    assert_equal(1, !errors && next[0] == STAGING_ELEMS_COUNT && next[1] == STAGING_ELEMS_COUNT, "SPIFFS ISR Staging. Two producers enqueue from ISR concurrently, flush moves all to the queue in per-producer order.");
+    printf("        Elems producer 0/1 (%d/%d), order errors %d\n", next[0], next[1], errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium async test cases //////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+#define ASYNC_ELEMS_COUNT               40
+
+typedef struct {
+    uint16_t completed;
+    uint16_t succeeded;
+    uint16_t sizes[ASYNC_ELEMS_COUNT];
+    SemaphoreHandle_t done;
+} async_test_ctx_t;
+
+void _async_test_cb(circular_queue_t *q, const uint8_t result, const uint16_t elem_size, void *arg) {
+    async_test_ctx_t *ctx = (async_test_ctx_t *)arg;
+
+    (void)q;
+    ctx->sizes[ctx->completed++] = elem_size;
+    ctx->succeeded += result;
+    if (ctx->completed == ASYNC_ELEMS_COUNT) xSemaphoreGive(ctx->done);
+}
+
+void spiffs_async_enqueue_dequeue(void) {
+    static uint8_t in[ASYNC_ELEMS_COUNT][sizeof(uint32_t)*4];
+    static uint8_t out[ASYNC_ELEMS_COUNT][sizeof(uint32_t)*4];
+    async_test_ctx_t enq = {0, 0, {0}, xSemaphoreCreateBinary()};
+    async_test_ctx_t deq = {0, 0, {0}, xSemaphoreCreateBinary()};
+    uint32_t errors = 0;
+
+    for (uint16_t n = 0; n < ASYNC_ELEMS_COUNT; n++) {
+        memset(in[n], n, sizeof(in[n]));
+        // async calls return at once, retry when the worker is behind
+        while (!spiffs_circular_queue_enqueue_async(&cq, in[n], n % sizeof(in[n]) + 1, _async_test_cb, &enq)) {
+            vTaskDelay(1);
+        }
+    }
+    for (uint16_t n = 0; n < ASYNC_ELEMS_COUNT; n++) {
+        while (!spiffs_circular_queue_dequeue_async(&cq, out[n], _async_test_cb, &deq)) {
+            vTaskDelay(1);
+        }
+    }
+
+    xSemaphoreTake(enq.done, pdMS_TO_TICKS(5000));
+    xSemaphoreTake(deq.done, pdMS_TO_TICKS(5000));
+    vSemaphoreDelete(enq.done);
+    vSemaphoreDelete(deq.done);
+
+    for (uint16_t n = 0; n < ASYNC_ELEMS_COUNT; n++) {
+        uint16_t expc_size = cq.elem_size? cq.elem_size : n % sizeof(in[n]) + 1;
+        errors += deq.sizes[n] != expc_size || memcmp(in[n], out[n], expc_size);
+    }
+
+    assert_equal(1, enq.succeeded == ASYNC_ELEMS_COUNT && deq.succeeded == ASYNC_ELEMS_COUNT && !errors && cq.is_empty(&cq), 
+        "SPIFFS Async. Enqueue and dequeue through the I/O worker, callbacks, order and content checked.");
+    printf("        Enqueued/Dequeued (%d/%d), errors %d\n", enq.succeeded, deq.succeeded, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium cursors test cases ////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+#define CURSORS_ELEMS_COUNT             10
+
+void spiffs_cursors_dequeue_for(void) {
+    static circular_queue_t q = {};
+    uint8_t cloud = 0, ble = 0, tmp = 0, again = 0;
+    uint32_t elem = 0;
+    uint16_t elem_size = 0;
+    uint32_t errors = 0;
+
+    // queues hold cursors on request only, the others keep the plain header
+    errors += spiffs_circular_queue_cursor_open(&cq, "cloud", &cloud) || cq.flags.fields.cursors;
+
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/cursors");
+    q.elem_size = cq.elem_size;
+    q.max_size = cq.max_size;
+    q.use_cursors = 1;
+    errors += !spiffs_circular_queue_init(&q);
+
+    errors += !spiffs_circular_queue_cursor_open(&q, "cloud", &cloud) || !spiffs_circular_queue_cursor_open(&q, "ble", &ble);
+    errors += !spiffs_circular_queue_cursor_open(&q, "cloud", &again) || again != cloud || cloud == ble;
+
+    for (elem = 0; elem < CURSORS_ELEMS_COUNT; elem++) {
+        errors += !q.enqueue(&q, (uint8_t *)&elem, sizeof(elem));
+    }
+
+    // the uplink reads all, nothing is reclaimed while the BLE sync lags
+    for (uint32_t n = 0; n < CURSORS_ELEMS_COUNT; n++) {
+        errors += !spiffs_circular_queue_dequeue_for(&q, cloud, &elem, &elem_size) || elem != n;
+    }
+    errors += spiffs_circular_queue_dequeue_for(&q, cloud, &elem, &elem_size);
+    errors += q.get_count(&q) != CURSORS_ELEMS_COUNT || spiffs_circular_queue_get_count_for(&q, cloud);
+
+    for (uint32_t n = 0; n < 4; n++) {
+        errors += !spiffs_circular_queue_dequeue_for(&q, ble, &elem, &elem_size) || elem != n;
+    }
+    errors += q.get_count(&q) != CURSORS_ELEMS_COUNT - 4;
+
+    // a closed cursor stops holding elems back
+    errors += !spiffs_circular_queue_cursor_open(&q, "tmp", &tmp) || spiffs_circular_queue_get_count_for(&q, tmp) != 6;
+    errors += !spiffs_circular_queue_cursor_close(&q, tmp);
+
+    // cursors survive re-initialization
+    errors += !spiffs_circular_queue_init(&q);
+    errors += spiffs_circular_queue_get_count_for(&q, cloud) || spiffs_circular_queue_get_count_for(&q, ble) != 6;
+
+    for (uint32_t n = 4; n < CURSORS_ELEMS_COUNT; n++) {
+        errors += !spiffs_circular_queue_dequeue_for(&q, ble, &elem, &elem_size) || elem != n;
+    }
+    errors += !q.is_empty(&q);
+
+    // the last cursor closed is gone from the flash too
+    errors += !spiffs_circular_queue_cursor_close(&q, cloud) || !spiffs_circular_queue_cursor_close(&q, ble);
+    errors += !spiffs_circular_queue_init(&q) || q.cursors[cloud].name[0] || q.cursors[ble].name[0];
+    errors += !q.free(&q, 0); // set zero to unmount on tear_down
+
+    assert_equal(1, !errors, "SPIFFS Cursors. Each cursor reads all elems, space reclaimed behind the slowest one.");
+    printf("        Errors %d\n", errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium recovery scan test cases //////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+#define RECOVERY_ELEMS_COUNT            10
+#define RECOVERY_STALE_ELEMS            7
+
+void spiffs_recovery_scan(void) {
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+    uint16_t buf_size = 0;
+    uint32_t errors = 0;
+
+    for (uint16_t n = 1; n <= RECOVERY_ELEMS_COUNT; n++) {
+        memset(buf, n, sizeof(buf));
+        errors += !cq.enqueue(&cq, buf, n);
+    }
+
+    // a header pointing past the data the file holds, as left by a crash
+    uint32_t back_idx = cq.back_idx + 100;
+    uint16_t count = cq.count + RECOVERY_STALE_ELEMS;
+    FILE *fd = fopen(cq.fn, "r+b");
+    fseek(fd, sizeof(cq.front_idx), SEEK_SET);
+    fwrite(&back_idx, 1, sizeof(back_idx), fd);
+    fwrite(&count, 1, sizeof(count), fd);
+    fclose(fd);
+
+    errors += !spiffs_circular_queue_init(&cq);
+    errors += cq.get_count(&cq) != RECOVERY_ELEMS_COUNT || cq.recovered != RECOVERY_STALE_ELEMS;
+
+    for (uint16_t n = 1; n <= RECOVERY_ELEMS_COUNT; n++) {
+        errors += !cq.dequeue(&cq, buf, &buf_size) || buf[0] != n || (!cq.elem_size && buf_size != n);
+    }
+    errors += !cq.is_empty(&cq);
+
+    assert_equal(1, !errors, "SPIFFS Recovery Scan. Stale header cut down to the last consistent elem on init.");
+    printf("        Dropped %d, scan time %d us, errors %d\n", cq.recovered, spiffs_circular_queue_get_recovery_time(&cq), errors);
+}
+
+void spiffs_recovery_scan_timing(void) {
+    static circular_queue_t q = {};
+    uint8_t elem[16] = {0};
+    uint32_t errors = 0;
+
+    // full queues of growing size, re-initialized as on wake-up
+    for (uint32_t max_size = 512; max_size <= 4096; max_size *= 2) {
+        snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/scan");
+        q.elem_size = cq.elem_size;
+        q.max_size = max_size;
+        errors += !spiffs_circular_queue_init(&q);
+        while (q.enqueue(&q, elem, sizeof(elem)));
+        uint16_t count = q.count;
+
+        errors += !spiffs_circular_queue_init(&q) || q.count != count;
+        errors += !q.free(&q, 0); // set zero to unmount on tear_down
+    }
+
+    assert_equal(1, !errors, "SPIFFS Recovery Scan Timing. Consistent full queues kept intact by the scan.");
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium deferred persist test cases ////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+#define DEFERRED_ELEMS_COUNT            10
+#define DEFERRED_DEQUEUED_COUNT         3
+
+// header front index and count as on the flash
+void _flash_header(const char *fn, uint32_t *front_idx, uint16_t *count) {
+    FILE *fd = fopen(fn, "rb");
+    fread(front_idx, 1, sizeof(*front_idx), fd);
+    fseek(fd, sizeof(uint32_t)*2, SEEK_SET);
+    fread(count, 1, sizeof(*count), fd);
+    fclose(fd);
+}
+
+void spiffs_deferred_persist_sync_all(void) {
+    static circular_queue_t q = {};
+    uint32_t elem[4] = {0};
+    uint16_t elem_size = 0;
+    uint32_t front_idx = 0;
+    uint16_t count = 0;
+    uint32_t errors = 0;
+
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/defer");
+    q.elem_size = cq.elem_size;
+    q.max_size = cq.max_size;
+    errors += !spiffs_circular_queue_init(&q);
+    errors += !spiffs_circular_queue_defer_persist(&cq, 1) || !spiffs_circular_queue_defer_persist(&q, 1);
+
+    // headers stay in RAM until synced, both queues in one pass
+    for (elem[0] = 0; elem[0] < DEFERRED_ELEMS_COUNT; elem[0]++) {
+        errors += !cq.enqueue(&cq, elem, sizeof(elem)) || !q.enqueue(&q, elem, sizeof(elem));
+    }
+    _flash_header(cq.fn, &front_idx, &count);
+    errors += count != 0;
+    errors += !spiffs_circular_queue_sync_all();
+    _flash_header(cq.fn, &front_idx, &count);
+    errors += count != DEFERRED_ELEMS_COUNT;
+    _flash_header(q.fn, &front_idx, &count);
+    errors += count != DEFERRED_ELEMS_COUNT;
+    errors += !q.free(&q, 0); // set zero to unmount on tear_down
+
+    // fill up, synced, then free some space without a persist
+    while (cq.enqueue(&cq, elem, sizeof(elem))) elem[0]++;
+    uint16_t full_count = cq.count;
+    errors += !spiffs_circular_queue_sync(&cq);
+    for (uint16_t i = 0; i < DEFERRED_DEQUEUED_COUNT; i++) {
+        errors += !cq.dequeue(&cq, elem, &elem_size) || elem[0] != i;
+    }
+    _flash_header(cq.fn, &front_idx, &count);
+    errors += count != full_count;
+
+    // freed space is reused only after the header moved past it
+    errors += !cq.enqueue(&cq, elem, sizeof(elem));
+    _flash_header(cq.fn, &front_idx, &count);
+    errors += front_idx != cq.front_idx || count != full_count - DEFERRED_DEQUEUED_COUNT;
+
+    // a reset before the next sync loses only the last enqueue
+    errors += !spiffs_circular_queue_init(&cq);
+    errors += cq.count != full_count - DEFERRED_DEQUEUED_COUNT;
+    errors += !cq.front(&cq, elem, &elem_size) || elem[0] != DEFERRED_DEQUEUED_COUNT;
+    errors += !spiffs_circular_queue_defer_persist(&cq, 0);
+
+    assert_equal(1, !errors, "SPIFFS Deferred Persist. Headers written on sync_all only, freed space kept until persisted.");
+    printf("        Full count %d, errors %d\n", full_count, errors);
+}
+
+#define DURABILITY_ELEMS_COUNT          3
+
+void spiffs_durability_levels(void) {
+    uint32_t elem[4] = {0};
+    uint16_t elem_size = 0;
+    uint32_t front_idx = 0;
+    uint16_t count = 0;
+    uint32_t errors = 0;
+    uint32_t n = 0;
+
+    // data synced, header left to the next full enqueue
+    for (uint16_t i = 0; i < DURABILITY_ELEMS_COUNT; i++, n++) {
+        elem[0] = n;
+        errors += !spiffs_circular_queue_enqueue_durable(&cq, elem, sizeof(elem), CIRCULAR_QUEUE_DURABILITY_DATA);
+    }
+    _flash_header(cq.fn, &front_idx, &count);
+    errors += count != 0 || cq.count != DURABILITY_ELEMS_COUNT;
+
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    // buffered in RAM, the full enqueue after them keeps the order
+    errors += !spiffs_circular_queue_frontend_init(&cq, 256);
+    for (uint16_t i = 0; i < DURABILITY_ELEMS_COUNT; i++, n++) {
+        elem[0] = n;
+        errors += !spiffs_circular_queue_enqueue_durable(&cq, elem, sizeof(elem), CIRCULAR_QUEUE_DURABILITY_NONE);
+    }
+#endif
+    elem[0] = n++;
+    errors += !spiffs_circular_queue_enqueue_durable(&cq, elem, sizeof(elem), CIRCULAR_QUEUE_DURABILITY_FULL);
+    _flash_header(cq.fn, &front_idx, &count);
+    errors += count != n || cq.count != n;
+
+    // a reset keeps everything up to the full enqueue
+    errors += !spiffs_circular_queue_init(&cq);
+    for (uint32_t i = 0; i < n; i++) {
+        errors += !cq.dequeue(&cq, elem, &elem_size) || elem[0] != i;
+    }
+    errors += !cq.is_empty(&cq);
+
+    assert_equal(1, !errors, "SPIFFS Durability Levels. Data-only enqueues covered by the next full one, order kept.");
+    printf("        Elems %d, errors %d\n", n, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium power cut test cases //////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+#define FAULT_PREFILL_COUNT             4
+#define FAULT_WORKLOAD                  "EEDEDDEE" // E enqueue, D dequeue
+#define FAULT_MODEL_SIZE                (FAULT_PREFILL_COUNT + sizeof(FAULT_WORKLOAD))
+
+// elem id repeated over the elem, variable elems size depends on the id
+uint16_t _fault_elem(uint8_t id, uint8_t *elem) {
+    uint16_t size = 4 + id%8;
+
+    memset(elem, id, size);
+    return size;
+}
+
+// queue content as ids, 0 on a malformed elem
+uint16_t _fault_content(circular_queue_t *q, uint8_t *ids) {
+    uint8_t elem[16] = {0};
+    uint16_t elem_size = 0;
+    uint16_t n = 0;
+
+    while (n < FAULT_MODEL_SIZE && q->dequeue(q, elem, &elem_size)) {
+        uint8_t expected[16] = {0};
+        uint16_t size = _fault_elem(elem[0], expected);
+
+        ids[n++] = !memcmp(elem, expected, q->elem_size? q->elem_size : size) && 
+            (q->elem_size || elem_size == size)? elem[0] : 0;
+    }
+
+    return n;
+}
+
+// queue ids after the first ops of the workload
+uint16_t _fault_model(uint16_t ops, uint8_t *ids) {
+    uint8_t next_id = 1, front = 0, back = 0;
+
+    while (back < FAULT_PREFILL_COUNT) ids[back++] = next_id++;
+    for (uint16_t i = 0; i < ops; i++) {
+        if (FAULT_WORKLOAD[i] == 'E') ids[back++] = next_id++;
+        else front++;
+    }
+    memmove(ids, &ids[front], back - front);
+
+    return back - front;
+}
+
+// runs the workload with a power cut after write cut_after, returns the ops completed before it
+uint16_t _fault_scenario(circular_queue_t *q, uint32_t cut_after, uint32_t torn_size, uint16_t page_size, 
+                         uint32_t *writes) {
+    uint8_t elem[16] = {0};
+    uint16_t elem_size = 0;
+    uint8_t next_id = 1;
+    uint16_t done = 0;
+    uint8_t alive = 1;
+
+    snprintf(q->fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/fault");
+    q->elem_size = cq.elem_size;
+    q->max_size = 64; // wraps around within the workload
+    spiffs_circular_queue_init(q);
+    while (next_id <= FAULT_PREFILL_COUNT) q->enqueue(q, elem, _fault_elem(next_id++, elem));
+
+    alive = spiffs_circular_queue_fault_arm(cut_after, torn_size, page_size);
+    for (uint16_t i = 0; alive && i < sizeof(FAULT_WORKLOAD) - 1; i++) {
+        alive = FAULT_WORKLOAD[i] == 'E'? q->enqueue(q, elem, _fault_elem(next_id++, elem)) : q->dequeue(q, elem, &elem_size);
+        done += alive;
+    }
+    *writes = spiffs_circular_queue_fault_disarm();
+
+    return done;
+}
+
+void spiffs_power_cut_sweep(void) {
+    static circular_queue_t q = {};
+    uint32_t errors = 0, scenarios = 0, writes = 0;
+    uint32_t torn_sizes[] = {CIRCULAR_QUEUE_FAULT_NOT_TORN, 1};
+    uint16_t page_sizes[] = {SPIFFS_CIRCULAR_QUEUE_FAULT_PAGE_SIZE, 16}; // small pages program partial headers
+    uint32_t start = millis();
+
+    // count the workload writes, without a cut
+    errors += _fault_scenario(&q, UINT32_MAX, CIRCULAR_QUEUE_FAULT_NOT_TORN, SPIFFS_CIRCULAR_QUEUE_FAULT_PAGE_SIZE, 
+                              &writes) != sizeof(FAULT_WORKLOAD) - 1;
+    errors += !q.free(&q, 0);
+    uint32_t total_writes = writes;
+
+    // every crash point, the queue must come back as before or after the interrupted op
+    for (uint8_t p = 0; p < sizeof(page_sizes)/sizeof(page_sizes[0]); p++) {
+        for (uint8_t t = 0; t < sizeof(torn_sizes)/sizeof(torn_sizes[0]); t++) {
+            for (uint32_t cut_after = 1; cut_after <= total_writes; cut_after++, scenarios++) {
+                uint8_t ids[FAULT_MODEL_SIZE], before[FAULT_MODEL_SIZE], after[FAULT_MODEL_SIZE];
+                uint16_t done = _fault_scenario(&q, cut_after, torn_sizes[t], page_sizes[p], &writes);
+
+                errors += !spiffs_circular_queue_init(&q);
+                uint16_t n = _fault_content(&q, ids);
+                uint16_t n_before = _fault_model(done, before);
+                uint16_t n_after = _fault_model(done + 1, after);
+                uint8_t ok = (n == n_before && !memcmp(ids, before, n)) || (n == n_after && !memcmp(ids, after, n));
+                if (!ok) printf("        Cut after write %d of %d, torn %d, page %d, ops done %d, elems %d\n", 
+                    cut_after, total_writes, torn_sizes[t] != CIRCULAR_QUEUE_FAULT_NOT_TORN, page_sizes[p], done, n);
+                errors += !ok;
+                errors += !q.free(&q, 0); // set zero to unmount on tear_down
+            }
+        }
+    }
+
+    uint32_t elapsed = millis() - start;
+
+    assert_equal(1, !errors, "SPIFFS Power Cut Sweep. Queue consistent after a cut at every write of the workload.");
+    printf("        Scenarios %d, writes %d, %d ms, errors %d\n", scenarios, total_writes, elapsed, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium idle maintenance test cases ///////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_IDLE_GC
+#define MAINTAIN_ROUNDS                 200
+#define MAINTAIN_BUDGET_MS              100
+
+void spiffs_maintain_idle_gc(void) {
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+    uint16_t buf_size = 0;
+    uint32_t errors = 0, failed = 0, max_enqueue_us = 0, max_maintain_us = 0;
+
+    // garbage collection in the idle time between bursts, the queue wraps several times
+    for (uint16_t n = 0; n < MAINTAIN_ROUNDS; n++) {
+        uint16_t size = 1 + n % (CIRCULAR_QUEUE_MAX_ELEM_SIZE - 1);
+        uint32_t start = micros();
+
+        memset(buf, n, sizeof(buf));
+        errors += !cq.enqueue(&cq, buf, size);
+        uint32_t us = micros() - start;
+        if (us > max_enqueue_us) max_enqueue_us = us;
+
+        if (n % 4 == 3) {
+            for (uint16_t i = n - 3; i <= n; i++) {
+                errors += !cq.dequeue(&cq, buf, &buf_size) || buf[0] != (uint8_t)i || 
+                    (!cq.elem_size && buf_size != 1 + i % (CIRCULAR_QUEUE_MAX_ELEM_SIZE - 1));
+            }
+            start = micros();
+            failed += !spiffs_circular_queue_maintain(&cq, MAINTAIN_BUDGET_MS);
+            us = micros() - start;
+            if (us > max_maintain_us) max_maintain_us = us;
+        }
+    }
+    errors += !cq.is_empty(&cq);
+
+    assert_equal(1, !errors && !failed, "SPIFFS Idle Maintenance. Garbage collection between bursts, content checked.");
+    printf("        Max enqueue %d us, max maintain %d us, maintain failed %d, errors %d\n", 
+        max_enqueue_us, max_maintain_us, failed, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium space manager test cases //////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+void spiffs_space_headroom(void) {
+    circular_queue_t q;
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+    uint32_t errors = 0;
+    uint32_t headroom = spiffs_circular_queue_get_headroom();
+    uint32_t half = headroom/2, left = 0;
+
+    errors += !headroom;
+
+    // a queue whose header doesn't fit the headroom anymore is refused
+    memset(&q, 0x0, sizeof(q));
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/headroom");
+    q.max_size = headroom;
+    errors += spiffs_circular_queue_init(&q);
+
+    // the new queue takes its full size from the headroom, writing its file doesn't take more
+    q.max_size = half;
+    if (spiffs_circular_queue_init(&q)) {
+        left = spiffs_circular_queue_get_headroom();
+        errors += left > headroom - half;
+        errors += !q.enqueue(&q, buf, sizeof(buf));
+        errors += spiffs_circular_queue_get_headroom() > left;
+        errors += !q.free(&q, 0);
+    } else {
+        errors++;
+    }
+    // the reservation is gone with the queue
+    errors += spiffs_circular_queue_get_headroom() <= left;
+
+    assert_equal(1, !errors, "SPIFFS Space Manager. New queues admitted under the high-water mark only.");
+    printf("        Headroom %d bytes, %d bytes with a %d bytes queue, errors %d\n", headroom, left, half, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium blocking calls test cases /////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+#define WAIT_ELEMS_COUNT                300 // wraps both test queues
+#define WAIT_TIMEOUT_MS                 50
+
+// enqueues WAIT_ELEMS_COUNT elems blocking on a full queue
+void _wait_producer_task(void *arg) {
+    concurrent_test_ctx_t *ctx = (concurrent_test_ctx_t *)arg;
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+
+    for (uint32_t n = 0; n < WAIT_ELEMS_COUNT; n++) {
+        memset(buf, n, sizeof(buf));
+        ctx->errors += !spiffs_circular_queue_enqueue_wait(&cq, buf, n % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1, 
+            CIRCULAR_QUEUE_WAIT_FOREVER);
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+void spiffs_wait_producer_consumer(void) {
+    concurrent_test_ctx_t ctx = {0, 0, xSemaphoreCreateBinary()};
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+    uint16_t buf_size = 0;
+    uint32_t errors = 0;
+
+    // an empty queue times out, not earlier
+    uint32_t start = millis();
+    errors += spiffs_circular_queue_dequeue_wait(&cq, buf, &buf_size, WAIT_TIMEOUT_MS);
+    uint32_t waited_ms = millis() - start;
+    errors += waited_ms < WAIT_TIMEOUT_MS;
+
+    // an elem larger than the queue fails without waiting
+    if (!cq.elem_size) {
+        start = millis();
+        errors += spiffs_circular_queue_enqueue_wait(&cq, buf, cq.max_size, CIRCULAR_QUEUE_WAIT_FOREVER);
+        errors += millis() - start >= WAIT_TIMEOUT_MS;
+    }
+
+    // the consumer is slower at first, the producer waits for space
+    xTaskCreatePinnedToCore(_wait_producer_task, "producer", 4096, &ctx, 1, NULL, 0);
+    delay(WAIT_TIMEOUT_MS);
+    for (uint32_t n = 0; n < WAIT_ELEMS_COUNT; n++) {
+        if (spiffs_circular_queue_dequeue_wait(&cq, buf, &buf_size, 1000)) {
+            errors += buf[0] != (uint8_t)n || (!cq.elem_size && buf_size != n % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1);
+        } else {
+            errors++;
+        }
+    }
+    xSemaphoreTake(ctx.done, portMAX_DELAY);
+    vSemaphoreDelete(ctx.done);
+    errors += ctx.errors || !cq.is_empty(&cq);
+
+    assert_equal(1, !errors, "SPIFFS Blocking Calls. Producer waits for space, consumer for elems, order checked.");
+    printf("        Empty queue waited %d ms of %d, errors %d\n", waited_ms, WAIT_TIMEOUT_MS, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium watermarks test cases /////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+#define WATERMARK_HIGH_ELEMS            8
+#define WATERMARK_LOW_ELEMS             2
+
+typedef struct {
+    uint16_t high;
+    uint16_t low;
+    uint16_t count_at_high;
+    circular_queue_t *log;  // another queue the callback writes the crossings to
+} watermark_test_ctx_t;
+
+void _watermark_cb(circular_queue_t *q, const circular_queue_watermark_t crossed, void *arg) {
+    watermark_test_ctx_t *ctx = (watermark_test_ctx_t *)arg;
+
+    spiffs_circular_queue_enqueue(ctx->log, &crossed, sizeof(crossed));
+    if (crossed == CIRCULAR_QUEUE_WATERMARK_HIGH) {
+        ctx->high++;
+        ctx->count_at_high = q->count;
+    } else {
+        ctx->low++;
+    }
+}
+
+void spiffs_watermark_callbacks(void) {
+    static circular_queue_t log = {};
+    watermark_test_ctx_t ctx = {0, 0, 0, &log};
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+    uint16_t buf_size = 0;
+    uint32_t errors = 0;
+
+    snprintf(log.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/wmlog");
+    log.elem_size = sizeof(circular_queue_watermark_t);
+    log.max_size = 64*sizeof(circular_queue_watermark_t);
+    errors += !spiffs_circular_queue_init(&log);
+
+    errors += spiffs_circular_queue_set_watermarks(&cq, WATERMARK_LOW_ELEMS, WATERMARK_HIGH_ELEMS, 
+        CIRCULAR_QUEUE_WATERMARK_ELEMS, _watermark_cb, &ctx);
+    errors += !spiffs_circular_queue_set_watermarks(&cq, WATERMARK_HIGH_ELEMS, WATERMARK_LOW_ELEMS, 
+        CIRCULAR_QUEUE_WATERMARK_ELEMS, _watermark_cb, &ctx);
+
+    // two bursts up and down, hysteresis keeps one callback per crossing
+    for (uint8_t burst = 0; burst < 2; burst++) {
+        for (uint16_t n = 0; n < WATERMARK_HIGH_ELEMS + 2; n++) errors += !cq.enqueue(&cq, buf, sizeof(uint32_t));
+        errors += ctx.high != burst + 1 || ctx.count_at_high != WATERMARK_HIGH_ELEMS || ctx.low != burst;
+        while (cq.get_count(&cq) > WATERMARK_LOW_ELEMS - 1) errors += !cq.dequeue(&cq, buf, &buf_size);
+        errors += ctx.low != burst + 1;
+    }
+
+    // bytes unit, the level is at high already on registration
+    errors += !spiffs_circular_queue_set_watermarks(&cq, cq.size(&cq), 0, CIRCULAR_QUEUE_WATERMARK_BYTES, _watermark_cb, &ctx);
+    errors += ctx.high != 3;
+    while (cq.dequeue(&cq, buf, &buf_size));
+    errors += ctx.low != 3;
+
+    errors += !spiffs_circular_queue_set_watermarks(&cq, 0, 0, CIRCULAR_QUEUE_WATERMARK_ELEMS, NULL);
+    // the callbacks ran with the queue file handle released, free to use other queues
+    errors += log.get_count(&log) != ctx.high + ctx.low;
+    errors += !log.free(&log, 0); // set zero to unmount on tear_down
+
+    assert_equal(1, !errors, "SPIFFS Watermarks. High and low callbacks once per crossing, elems and bytes.");
+    printf("        High %d, low %d, errors %d\n", ctx.high, ctx.low, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium scatter-gather test cases /////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define GATHER_ELEMS_COUNT              200 // wraps both test queues
+
+void spiffs_enqueuev_fragments(void) {
+    uint8_t head[3], payload[CIRCULAR_QUEUE_MAX_ELEM_SIZE], trailer[2];
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE + sizeof(head) + sizeof(trailer)];
+    uint16_t buf_size = 0;
+    uint32_t errors = 0;
+
+    for (uint16_t n = 0; n < GATHER_ELEMS_COUNT; n++) {
+        // header, payload and trailer of a packet, an empty payload in between. Fixed queues take 1+2+1 bytes
+        uint16_t payload_size = cq.elem_size? 2 : n % CIRCULAR_QUEUE_MAX_ELEM_SIZE;
+        circular_queue_iovec_t iov[4] = {
+            {head, (uint16_t)(cq.elem_size? 1 : sizeof(head))}, {NULL, 0}, 
+            {payload, payload_size}, {trailer, (uint16_t)(cq.elem_size? 1 : sizeof(trailer))}
+        };
+        uint16_t total = iov[0].len + iov[2].len + iov[3].len;
+
+        memset(head, 0xA0, sizeof(head));
+        head[0] = n;
+        memset(payload, n + 1, sizeof(payload));
+        memset(trailer, 0x5A, sizeof(trailer));
+
+        errors += !spiffs_circular_queue_enqueuev(&cq, iov, 4);
+        if (!cq.dequeue(&cq, buf, &buf_size)) {
+            errors++;
+        } else {
+            errors += (!cq.elem_size && buf_size != total) || buf[0] != (uint8_t)n || 
+                buf[total - 1] != 0x5A || (payload_size && buf[iov[0].len] != (uint8_t)(n + 1));
+        }
+        // an extra elem now and then moves the file end to another fragment
+        if (n % 7 == 0) errors += !spiffs_circular_queue_enqueuev(&cq, iov, 4) || !cq.dequeue(&cq, buf, &buf_size);
+    }
+
+    // fixed elem size needs the exact elem size in total
+    if (cq.elem_size) {
+        circular_queue_iovec_t iov[2] = {{head, sizeof(head)}, {trailer, sizeof(trailer)}};
+        errors += spiffs_circular_queue_enqueuev(&cq, iov, 2);
+    }
+    errors += spiffs_circular_queue_enqueuev(&cq, NULL, 0) || !cq.is_empty(&cq);
+
+    assert_equal(1, !errors, "SPIFFS Scatter-Gather Enqueue. Fragments gathered into elems over the file end.");
+    printf("        Elems %d, errors %d\n", GATHER_ELEMS_COUNT, errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium in-place serialization test cases /////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define WRITER_ELEMS_COUNT              200 // wraps both test queues
+
+typedef struct {
+    uint16_t n;             // elem number, the first byte
+    uint16_t size;          // elem size to write
+    uint8_t commit;         // callback result
+} writer_test_ctx_t;
+
+// writes the elem byte by byte, as an encoder output callback would
+uint8_t _writer_cb(circular_queue_writer_t *writer, void *arg) {
+    writer_test_ctx_t *ctx = (writer_test_ctx_t *)arg;
+    uint8_t ok = 1;
+
+    for (uint16_t i = 0; ok && i < ctx->size; i++) {
+        uint8_t byte = i? ctx->n + i : ctx->n;
+        ok = spiffs_circular_queue_writer_put(writer, &byte, 1);
+    }
+
+    return ctx->commit;
+}
+
+void spiffs_enqueue_with_writer(void) {
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE];
+    uint16_t buf_size = 0;
+    uint32_t errors = 0;
+
+    for (uint16_t n = 0; n < WRITER_ELEMS_COUNT; n++) {
+        uint16_t size = cq.elem_size? cq.elem_size : n % (CIRCULAR_QUEUE_MAX_ELEM_SIZE - 1) + 1;
+        writer_test_ctx_t ctx = {n, size, 1};
+
+        // dropped by the callback, or written past max_len, nothing is enqueued
+        if (n % 5 == 0) {
+            writer_test_ctx_t dropped = {n, size, 0};
+            writer_test_ctx_t oversized = {n, (uint16_t)(size + 1), 1};
+
+            errors += spiffs_circular_queue_enqueue_with(&cq, size, _writer_cb, &dropped);
+            errors += spiffs_circular_queue_enqueue_with(&cq, size, _writer_cb, &oversized);
+            errors += !cq.is_empty(&cq);
+        }
+
+        errors += !spiffs_circular_queue_enqueue_with(&cq, CIRCULAR_QUEUE_MAX_ELEM_SIZE - 1, _writer_cb, &ctx);
+        if (cq.dequeue(&cq, buf, &buf_size)) {
+            errors += (!cq.elem_size && buf_size != size) || buf[0] != (uint8_t)n || buf[size - 1] != (uint8_t)(size > 1? n + size - 1 : n);
+        } else {
+            errors++;
+        }
+    }
+    errors += !cq.is_empty(&cq);
+
+    assert_equal(1, !errors, "SPIFFS Enqueue With Writer. Elems serialized in place, dropped ones leave no trace.");
+    printf("        Elems %d, errors %d\n", WRITER_ELEMS_COUNT, errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium zero-copy consume test cases //////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define CONSUME_ROUNDS                  20
+#define CONSUME_BATCH                   8
+#define CONSUME_BIG_SIZE                (SPIFFS_CIRCULAR_QUEUE_CONSUME_BUFFER_SIZE + 100) // read on its own
+
+typedef struct {
+    uint16_t next;          // expected elem number
+    uint16_t stop_after;    // elems accepted before stopping
+    uint32_t errors;
+} consume_test_ctx_t;
+
+uint8_t _consume_cb(const void *elem, const uint16_t elem_size, void *arg) {
+    consume_test_ctx_t *ctx = (consume_test_ctx_t *)arg;
+    const uint8_t *bytes = (const uint8_t *)elem;
+    uint8_t ret = ctx->stop_after > 0;
+
+    if (ret) {
+        ctx->errors += bytes[0] != (uint8_t)ctx->next || bytes[elem_size - 1] != (uint8_t)ctx->next ||
+            (test_type == TEST_TYPE_VARIABLE_ELEM_SIZE && elem_size != ctx->next % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1);
+        ctx->next++;
+        ctx->stop_after--;
+    }
+
+    return ret;
+}
+
+uint8_t _consume_size_cb(const void *elem, const uint16_t elem_size, void *arg) {
+    *(uint16_t *)arg = elem_size;
+
+    return ((const uint8_t *)elem)[elem_size - 1] == (uint8_t)elem_size;
+}
+
+void spiffs_consume_zero_copy(void) {
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE];
+    uint16_t buf_size = 0, n = 0;
+    uint32_t errors = 0;
+    consume_test_ctx_t ctx = {0, 0, 0};
+
+    // batches of elems, consumed in two calls: the callback stops the first one midway
+    for (uint8_t round = 0; round < CONSUME_ROUNDS; round++) {
+        for (uint8_t i = 0; i < CONSUME_BATCH; i++, n++) {
+            memset(buf, n, sizeof(buf));
+            errors += !cq.enqueue(&cq, buf, n % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1);
+        }
+
+        ctx.stop_after = CONSUME_BATCH/2 - 1;
+        errors += spiffs_circular_queue_consume(&cq, CONSUME_BATCH, _consume_cb, &ctx) != CONSUME_BATCH/2 - 1;
+        ctx.stop_after = CONSUME_BATCH;
+        errors += spiffs_circular_queue_consume(&cq, 1, _consume_cb, &ctx) != 1;
+        errors += spiffs_circular_queue_consume(&cq, CONSUME_BATCH, _consume_cb, &ctx) != CONSUME_BATCH/2;
+        errors += !cq.is_empty(&cq) || ctx.next != n;
+    }
+
+    // what consume leaves is dequeued as usual
+    memset(buf, n, sizeof(buf));
+    errors += !cq.enqueue(&cq, buf, sizeof(uint32_t));
+    ctx.stop_after = 0;
+    errors += spiffs_circular_queue_consume(&cq, CONSUME_BATCH, _consume_cb, &ctx) != 0;
+    errors += !cq.dequeue(&cq, buf, &buf_size) || buf[0] != (uint8_t)n;
+    errors += ctx.errors;
+
+    // an elem larger than the read buffer is read on its own
+#if !SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE || SPIFFS_CIRCULAR_QUEUE_MAX_ELEM_SIZE > CONSUME_BIG_SIZE + 2 // size prefix
+    if (!cq.elem_size) {
+        static uint8_t big[CONSUME_BIG_SIZE];
+        memset(big, (uint8_t)sizeof(big), sizeof(big));
+        errors += !cq.enqueue(&cq, big, sizeof(big));
+        errors += spiffs_circular_queue_consume(&cq, CONSUME_BATCH, _consume_size_cb, &buf_size) != 1 || 
+            buf_size != sizeof(big) || !cq.is_empty(&cq);
+    }
+#endif
+
+    assert_equal(1, !errors, "SPIFFS Zero-Copy Consume. Elems handed over in batches, stop leaves the rest in order.");
+    printf("        Consumed %d, errors %d\n", ctx.next, errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium MTU frame dequeue test cases ///////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define FRAME_ELEMS_COUNT               300
+#define FRAME_MTU                       128
+
+// checks the frame elems are numbered from next on, returns the errors
+uint32_t _frame_check(const uint8_t *frame_buf, const circular_queue_frame_t *frame, uint16_t next) {
+    uint32_t errors = 0, pos = 0;
+    uint16_t size = cq.elem_size;
+
+    for (uint16_t i = 0; i < frame->count; i++, next++) {
+        if (!cq.elem_size) {
+            memcpy(&size, &frame_buf[pos], sizeof(size));
+            pos += sizeof(size);
+            errors += size != next % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1;
+        }
+        errors += frame_buf[pos] != (uint8_t)next || frame_buf[pos + size - 1] != (uint8_t)next;
+        pos += size;
+    }
+    errors += pos != frame->size || pos > FRAME_MTU;
+
+    return errors;
+}
+
+void spiffs_dequeue_frame_mtu(void) {
+    uint8_t buf[CIRCULAR_QUEUE_MAX_ELEM_SIZE], frame_buf[FRAME_MTU];
+    uint16_t buf_size = 0, in = 0, out = 0, frames = 0;
+    uint32_t errors = 0;
+    circular_queue_frame_t frame, resent;
+
+    // producer ahead of the frames, so they run over the file end
+    while (out < FRAME_ELEMS_COUNT) {
+        for (; in < FRAME_ELEMS_COUNT && in - out < 16; in++) {
+            memset(buf, in, sizeof(buf));
+            errors += !cq.enqueue(&cq, buf, in % CIRCULAR_QUEUE_MAX_ELEM_SIZE + 1);
+        }
+
+        errors += !spiffs_circular_queue_dequeue_frame(&cq, frame_buf, FRAME_MTU, &frame);
+        errors += _frame_check(frame_buf, &frame, out);
+        // no ack on every third frame, the same frame comes again
+        if (frames++ % 3 == 0) {
+            errors += !spiffs_circular_queue_dequeue_frame(&cq, frame_buf, FRAME_MTU, &resent);
+            errors += resent.count != frame.count || resent.size != frame.size || _frame_check(frame_buf, &resent, out);
+        }
+        errors += !spiffs_circular_queue_frame_commit(&cq, &frame);
+        out += frame.count;
+        errors += cq.count != in - out;
+    }
+    errors += !cq.is_empty(&cq);
+
+    // elems dequeued meanwhile make the frame stale, an elem over the mtu gives no frame
+    memset(buf, 0, sizeof(buf));
+    errors += !cq.enqueue(&cq, buf, sizeof(uint32_t)) || !cq.enqueue(&cq, buf, sizeof(uint32_t));
+    errors += !spiffs_circular_queue_dequeue_frame(&cq, frame_buf, FRAME_MTU, &frame) || frame.count != 2;
+    errors += !cq.dequeue(&cq, buf, &buf_size);
+    errors += spiffs_circular_queue_frame_commit(&cq, &frame);
+
+    // the front coming round to the frame start index after a whole lap doesn't make it fresh again
+    errors += !spiffs_circular_queue_dequeue_frame(&cq, frame_buf, FRAME_MTU, &frame) || frame.count != 1;
+    uint32_t front_idx = cq.get_front_idx(&cq);
+    for (uint16_t i = 0; i < 2*cq.max_size && (!i || cq.get_front_idx(&cq) != front_idx); i++) {
+        errors += !cq.enqueue(&cq, buf, sizeof(uint32_t)) || !cq.dequeue(&cq, buf, &buf_size);
+    }
+    errors += cq.get_front_idx(&cq) != front_idx || cq.count != 1;
+    errors += spiffs_circular_queue_frame_commit(&cq, &frame);
+    errors += spiffs_circular_queue_dequeue_frame(&cq, frame_buf, sizeof(uint16_t), &frame);
+    errors += !cq.dequeue(&cq, buf, &buf_size) || !cq.is_empty(&cq);
+
+    assert_equal(1, !errors, "SPIFFS MTU Frame Dequeue. Whole elems packed per frame, dequeued on commit only.");
+    printf("        Frames %d, elems %d, errors %d\n", frames, out, errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium block format test cases ////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+#define BLOCK_ELEMS_COUNT               200
+#define BLOCK_ELEM_MAX_SIZE             40
+#define BLOCK_TEST_SIZE                 128
+
+// flips the byte at the queue index idx, the file is full size
+void _block_corrupt(circular_queue_t *q, const uint32_t idx) {
+    uint8_t byte = 0;
+    FILE *fd = fopen(q->fn, "r+b");
+    uint32_t offset = q->get_file_size(q) - q->max_size + idx;
+
+    fseek(fd, offset, SEEK_SET);
+    fread(&byte, 1, sizeof(byte), fd);
+    byte ^= 0xFF;
+    fseek(fd, offset, SEEK_SET);
+    fwrite(&byte, 1, sizeof(byte), fd);
+    fclose(fd);
+}
+
+void spiffs_block_format(void) {
+    static circular_queue_t q = {};
+    uint8_t elem[BLOCK_ELEM_MAX_SIZE], buf[BLOCK_TEST_SIZE];
+    uint16_t in = 0, out = 0, blocks = 0, elem_size = 0;
+    uint32_t errors = 0;
+    const void *next = NULL;
+    circular_queue_block_t block;
+
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/blocks");
+    q.max_size = 1024;
+    q.block_size = BLOCK_TEST_SIZE;
+    errors += !spiffs_circular_queue_init(&q);
+
+    // a few blocks in the queue at a time, they go round the file end
+    while (out < BLOCK_ELEMS_COUNT && !errors) {
+        for (; in < BLOCK_ELEMS_COUNT && q.count < 3; in++) {
+            memset(elem, in, sizeof(elem));
+            errors += !spiffs_circular_queue_block_enqueue(&q, elem, in % BLOCK_ELEM_MAX_SIZE + 1);
+        }
+        if (in == BLOCK_ELEMS_COUNT) errors += !spiffs_circular_queue_block_flush(&q);
+
+        while (spiffs_circular_queue_block_dequeue(&q, buf, sizeof(buf), &block)) {
+            blocks++;
+            for (uint16_t i = 0; i < block.count; i++, out++) {
+                errors += !spiffs_circular_queue_block_next(&block, &next, &elem_size) || 
+                    elem_size != out % BLOCK_ELEM_MAX_SIZE + 1 || ((const uint8_t *)next)[elem_size - 1] != (uint8_t)out;
+            }
+            errors += spiffs_circular_queue_block_next(&block, &next, &elem_size);
+        }
+    }
+    errors += !q.is_empty(&q) || blocks >= BLOCK_ELEMS_COUNT/2;
+
+    // a broken last block is cut on init, a broken front one dropped on dequeue
+    for (uint8_t i = 0; i < 2; i++) {
+        errors += !spiffs_circular_queue_block_enqueue(&q, elem, sizeof(elem));
+        errors += !spiffs_circular_queue_block_flush(&q);
+    }
+    _block_corrupt(&q, (q.back_idx + q.max_size - 1) % q.max_size);
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+    errors += !spiffs_circular_queue_init(&q) || q.count != 1 || q.recovered != 1;
+    _block_corrupt(&q, (q.back_idx + q.max_size - 1) % q.max_size);
+#else
+    errors += !spiffs_circular_queue_block_dequeue(&q, buf, sizeof(buf), &block);
+#endif
+    errors += spiffs_circular_queue_block_dequeue(&q, buf, sizeof(buf), &block) || !q.is_empty(&q) || q.dropped != 1;
+    errors += !q.free(&q, 0); // set zero to unmount on tear_down
+
+    assert_equal(1, !errors, "SPIFFS Block Format. Elems batched per block, broken blocks caught by their CRC.");
+    printf("        Elems %d, blocks %d, errors %d\n", out, blocks, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium differential stress test cases /////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define STRESS_OPS_COUNT                20000
+#define STRESS_SEED                     0x2545F491u
+
+// xorshift32, the same sequence on every run
+uint32_t _stress_rand(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// elem bytes derived from its sequence number
+void _stress_fill(uint32_t seq, uint8_t *elem, uint16_t size) {
+    for (uint16_t i = 0; i < size; i++) elem[i] = (uint8_t)(seq*31 + i);
+}
+
+void spiffs_differential_stress(void) {
+    std::deque<std::vector<uint8_t>> model;
+    uint8_t elem[CIRCULAR_QUEUE_MAX_ELEM_SIZE] = {0};
+    uint16_t elem_size = 0;
+    uint32_t used = 0, seq = 0, state = STRESS_SEED;
+    uint32_t errors = 0, enqueued = 0, dequeued = 0, full = 0, empty = 0, reinits = 0;
+    uint16_t prefix = cq.elem_size? 0 : sizeof(uint16_t);
+    uint32_t start = millis();
+
+    for (uint32_t op = 0; op < STRESS_OPS_COUNT && errors < 10; op++) {
+        uint32_t r = _stress_rand(&state);
+
+        // enqueues prevail for a while then dequeues do, to run into full and empty edges
+        uint8_t enqueue_bias = (op/1000) % 2? 35 : 65;
+        uint8_t dice = r % 100;
+
+        if (dice < enqueue_bias) {
+            uint16_t size = cq.elem_size? cq.elem_size : 1 + (r >> 8) % (CIRCULAR_QUEUE_MAX_ELEM_SIZE - 1);
+            uint32_t gross = cq.max_size - used;
+            uint32_t available = gross <= prefix? 0 : gross - prefix;
+            uint8_t fits = available >= size;
+
+            _stress_fill(seq, elem, size);
+            uint8_t ret = cq.enqueue(&cq, elem, size);
+            errors += ret != fits;
+            if (ret) {
+                model.push_back(std::vector<uint8_t>(elem, elem + size));
+                used += size + prefix;
+                seq++;
+                enqueued++;
+            } else {
+                full++;
+            }
+        } else if (dice < 97) {
+            uint8_t peek = dice >= 90;
+            uint8_t ret = peek? cq.front(&cq, elem, &elem_size) : cq.dequeue(&cq, elem, &elem_size);
+
+            errors += ret != !model.empty();
+            if (ret && !model.empty()) {
+                const std::vector<uint8_t> &expected = model.front();
+                errors += (!cq.elem_size && elem_size != expected.size()) || memcmp(elem, expected.data(), expected.size());
+                if (!peek) {
+                    used -= expected.size() + prefix;
+                    model.pop_front();
+                    dequeued++;
+                }
+            } else if (!ret) {
+                empty++;
+            }
+        } else { // reinit, as after a reset
+            errors += !spiffs_circular_queue_init(&cq);
+            reinits++;
+        }
+
+        errors += cq.get_count(&cq) != model.size() || cq.size(&cq) != used - model.size()*prefix;
+    }
+    uint32_t elapsed = millis() - start;
+
+    assert_equal(1, !errors, "SPIFFS Differential Stress. Random operations checked against a deque model.");
+    printf("        Ops %d (enq %d, deq %d, full %d, empty %d, reinit %d), %d ops/s, errors %d\n", STRESS_OPS_COUNT, 
+        enqueued, dequeued, full, empty, reinits, elapsed? (uint32_t)(1000ull*STRESS_OPS_COUNT/elapsed) : 0, errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium file handle pool test cases ////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+#define POOL_QUEUES_COUNT               (SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE + 2)
+#define POOL_ELEMS_COUNT                20
+#define POOL_REPOINT_ELEMS_COUNT        5
+
+void spiffs_fd_pool_many_queues(void) {
+    static circular_queue_t queues[POOL_QUEUES_COUNT];
+    uint8_t initialized = 0;
+    uint32_t errors = 0;
+
+    for (uint8_t q = 0; q < POOL_QUEUES_COUNT; q++) {
+        memset(&queues[q], 0, sizeof(circular_queue_t));
+        snprintf(queues[q].fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/pool%d", q);
+        queues[q].elem_size = cq.elem_size;
+        queues[q].max_size = 256;
+        initialized += spiffs_circular_queue_init(&queues[q]);
+    }
+
+    // round robin over the queues, every operation evicts a handle of another queue
+    for (uint32_t n = 0; n < POOL_ELEMS_COUNT; n++) {
+        for (uint8_t q = 0; q < POOL_QUEUES_COUNT; q++) {
+            uint32_t elem = q*POOL_ELEMS_COUNT + n;
+            errors += !queues[q].enqueue(&queues[q], (uint8_t *)&elem, sizeof(elem));
+        }
+    }
+    for (uint32_t n = 0; n < POOL_ELEMS_COUNT; n++) {
+        for (uint8_t q = 0; q < POOL_QUEUES_COUNT; q++) {
+            uint32_t elem = 0;
+            uint16_t elem_size = 0;
+            errors += !queues[q].dequeue(&queues[q], (uint8_t *)&elem, &elem_size) || elem != q*POOL_ELEMS_COUNT + n;
+        }
+    }
+
+    for (uint8_t q = 0; q < POOL_QUEUES_COUNT; q++) {
+        errors += !queues[q].is_empty(&queues[q]);
+        queues[q].free(&queues[q], 0); // set zero to unmount on tear_down
+    }
+
+    assert_equal(1, initialized == POOL_QUEUES_COUNT && !errors, 
+        "SPIFFS File Handle Pool. More queues than pooled handles, interleaved enqueue and dequeue content checked.");
+    printf("        Queues %d, pool size %d, errors %d\n", initialized, SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE, errors);
+}
+
+void spiffs_fd_pool_repointed_queue(void) {
+    static circular_queue_t q;
+    uint8_t initialized = 0;
+    uint32_t errors = 0;
+    uint32_t elem = 0;
+    uint16_t elem_size = 0;
+
+    memset(&q, 0, sizeof(circular_queue_t));
+    q.elem_size = cq.elem_size;
+    q.max_size = 256;
+
+    // file B keeps its elems, file A is created next with the same struct
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/poolB");
+    initialized += spiffs_circular_queue_init(&q);
+    for (elem = 0; elem < POOL_REPOINT_ELEMS_COUNT; elem++) {
+        errors += !q.enqueue(&q, (uint8_t *)&elem, sizeof(elem));
+    }
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/poolA");
+    remove(q.fn);
+    initialized += spiffs_circular_queue_init(&q);
+    elem = 100;
+    errors += !q.enqueue(&q, (uint8_t *)&elem, sizeof(elem));
+
+    // the idle handle on file A is still pooled for the struct address
+    snprintf(q.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/poolB");
+    initialized += spiffs_circular_queue_init(&q);
+    uint16_t count = q.get_count(&q);
+    errors += !q.dequeue(&q, (uint8_t *)&elem, &elem_size) || elem != 0;
+
+    q.free(&q, 0); // set zero to unmount on tear_down
+    remove("/spiffs/poolA");
+
+    assert_equal(1, initialized == 3 && count == POOL_REPOINT_ELEMS_COUNT && !errors, 
+        "SPIFFS File Handle Pool. Queue struct re-pointed to another file, re-init reads the new file header.");
+    printf("        Count %d, errors %d\n", count, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium container test cases //////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+#define MULTI_QUEUES_COUNT              4
+#define MULTI_BLOCK_SIZE                32
+#define MULTI_BLOCKS_COUNT              32
+#define MULTI_ELEM_MAX_SIZE             40 // elems span blocks
+
+void spiffs_multi_queues_shared_area(void) {
+    static circular_queue_multi_t mq = {};
+    uint8_t buf[MULTI_ELEM_MAX_SIZE] = {0};
+    uint8_t expc[MULTI_ELEM_MAX_SIZE] = {0};
+    uint16_t buf_size = 0;
+    uint16_t enqueued[MULTI_QUEUES_COUNT] = {0};
+    uint32_t errors = 0;
+
+    snprintf(mq.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/multi");
+    mq.queues_count = MULTI_QUEUES_COUNT;
+    mq.block_size = MULTI_BLOCK_SIZE;
+    mq.blocks_count = MULTI_BLOCKS_COUNT;
+    errors += !spiffs_circular_queue_multi_init(&mq);
+
+    // interleaved low-rate queues, one handle and one header write for the whole batch
+    spiffs_circular_queue_multi_batch_begin(&mq);
+    for (uint8_t n = 0; n < 8; n++) {
+        for (uint8_t q = 1; q < MULTI_QUEUES_COUNT; q++) {
+            memset(buf, q*16 + n, n + q);
+            errors += !spiffs_circular_queue_multi_enqueue(&mq, q, buf, n + q);
+            enqueued[q]++;
+        }
+    }
+    errors += !spiffs_circular_queue_multi_batch_end(&mq);
+
+    // queue 0 takes the rest of the shared area, far more than a static split would give it
+    for (uint8_t n = 0; spiffs_circular_queue_multi_available_space(&mq) >= MULTI_BLOCK_SIZE*2; n++) {
+        memset(buf, n, MULTI_ELEM_MAX_SIZE);
+        errors += !spiffs_circular_queue_multi_enqueue(&mq, 0, buf, MULTI_ELEM_MAX_SIZE);
+        enqueued[0]++;
+    }
+
+    // state survives re-initialization
+    errors += !spiffs_circular_queue_multi_init(&mq);
+    for (uint8_t q = 0; q < MULTI_QUEUES_COUNT; q++) {
+        errors += spiffs_circular_queue_multi_get_count(&mq, q) != enqueued[q];
+    }
+
+    for (uint8_t n = 0; n < enqueued[0]; n++) {
+        memset(expc, n, MULTI_ELEM_MAX_SIZE);
+        errors += !spiffs_circular_queue_multi_dequeue(&mq, 0, buf, &buf_size) || buf_size != MULTI_ELEM_MAX_SIZE || 
+                  memcmp(buf, expc, buf_size);
+    }
+
+    // a persist writes only the changed queue and chain links, the rest of the header stays valid
+    errors += !spiffs_circular_queue_multi_init(&mq) || spiffs_circular_queue_multi_get_count(&mq, 0);
+    for (uint8_t q = 1; q < MULTI_QUEUES_COUNT; q++) {
+        errors += spiffs_circular_queue_multi_get_count(&mq, q) != enqueued[q];
+    }
+
+    for (uint8_t n = 0; n < 8; n++) {
+        for (uint8_t q = 1; q < MULTI_QUEUES_COUNT; q++) {
+            memset(expc, q*16 + n, n + q);
+            errors += !spiffs_circular_queue_multi_dequeue(&mq, q, buf, &buf_size) || buf_size != n + q || 
+                      memcmp(buf, expc, buf_size);
+        }
+    }
+
+    // every block is back in the shared area
+    errors += spiffs_circular_queue_multi_available_space(&mq) != MULTI_BLOCK_SIZE*MULTI_BLOCKS_COUNT;
+    errors += spiffs_circular_queue_multi_dequeue(&mq, 0, buf, &buf_size);
+
+    errors += !spiffs_circular_queue_multi_free(&mq, 0); // set zero to unmount on tear_down
+
+    assert_equal(1, !errors, "SPIFFS Container. Logical queues share one file and its data area, content checked.");
+    printf("        Queue 0 elems %d of %d bytes in a %d bytes area, errors %d\n", enqueued[0], MULTI_ELEM_MAX_SIZE, 
+        MULTI_BLOCK_SIZE*MULTI_BLOCKS_COUNT, errors);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////// SPIFFS medium priority queue test cases //////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+#define PRIO_LEVELS_COUNT               3
+
+void spiffs_prio_levels_order(void) {
+    static circular_queue_prio_t pq = {};
+    uint32_t elem = 0;
+    uint16_t elem_size = 0;
+    uint8_t level = 0;
+    uint16_t enqueued[PRIO_LEVELS_COUNT] = {0};
+    uint32_t errors = 0;
+
+    snprintf(pq.fn, SPIFFS_FILE_NAME_MAX_SIZE, "/spiffs/prio");
+    pq.levels_count = PRIO_LEVELS_COUNT;
+    pq.levels[0].max_size = 64;  // alarms
+    pq.levels[2].max_size = 256; // telemetry
+    errors += !spiffs_circular_queue_prio_init(&pq);
+
+    // routine telemetry fills its own level up
+    for (elem = 2000; spiffs_circular_queue_prio_enqueue(&pq, 2, &elem, sizeof(elem)); elem++) {
+        enqueued[2]++;
+    }
+    errors += spiffs_circular_queue_prio_nonempty(&pq) != 0x4;
+
+    // alarms still fit, they jump ahead
+    for (uint8_t n = 0; n < 5; n++) {
+        elem = 1000 + n;
+        enqueued[1] += spiffs_circular_queue_prio_enqueue(&pq, 1, &elem, sizeof(elem));
+        elem = n;
+        enqueued[0] += spiffs_circular_queue_prio_enqueue(&pq, 0, &elem, sizeof(elem));
+    }
+    errors += spiffs_circular_queue_prio_nonempty(&pq) != 0x7 || enqueued[0] != 5 || enqueued[1] != 5;
+
+    // state survives re-initialization
+    errors += !spiffs_circular_queue_prio_init(&pq);
+    errors += spiffs_circular_queue_prio_nonempty(&pq) != 0x7;
+    for (uint8_t l = 0; l < PRIO_LEVELS_COUNT; l++) {
+        errors += spiffs_circular_queue_prio_get_count(&pq, l) != enqueued[l];
+    }
+
+    // levels come out highest first, each in FIFO order
+    for (uint8_t l = 0; l < PRIO_LEVELS_COUNT; l++) {
+        for (uint16_t n = 0; n < enqueued[l]; n++) {
+            errors += !spiffs_circular_queue_prio_dequeue(&pq, &elem, &elem_size, &level) || level != l || 
+                      elem_size != sizeof(elem) || elem != l*1000u + n;
+        }
+    }
+    errors += spiffs_circular_queue_prio_nonempty(&pq) || spiffs_circular_queue_prio_dequeue(&pq, &elem, &elem_size);
+
+    // level ring wraps around its region end
+    for (uint16_t n = 0; n < enqueued[2]; n++) {
+        elem = 3000 + n;
+        errors += !spiffs_circular_queue_prio_enqueue(&pq, 2, &elem, sizeof(elem));
+        errors += !spiffs_circular_queue_prio_dequeue(&pq, &elem, &elem_size) || elem != 3000u + n;
+    }
+
+    errors += !spiffs_circular_queue_prio_free(&pq, 0); // set zero to unmount on tear_down
+
+    assert_equal(1, !errors, "SPIFFS Priority Queue. Highest non-empty level first, levels isolated, state persisted.");
+    printf("        Elems per level (%d/%d/%d), errors %d\n", enqueued[0], enqueued[1], enqueued[2], errors);
+}
+#endif
 
 void setup() {
     
@@ -710,6 +2323,90 @@ void loop() {
     delay(500);
     run_test(spiffs_is_empty_variable);
     delay(500);
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    run_test(spiffs_concurrent_producer_consumer);
+    delay(500);
+    run_test(spiffs_concurrent_persist_reinit);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    run_test(spiffs_frontend_enqueue_buffered);
+    delay(500);
+    run_test(spiffs_frontend_flush);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+    run_test(spiffs_staging_enqueue_from_isr);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+    run_test(spiffs_async_enqueue_dequeue);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+    run_test(spiffs_cursors_dequeue_for);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+    run_test(spiffs_recovery_scan);
+    delay(500);
+    run_test(spiffs_recovery_scan_timing);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    run_test(spiffs_deferred_persist_sync_all);
+    delay(500);
+    run_test(spiffs_durability_levels);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+    run_test(spiffs_power_cut_sweep);
+    delay(500);
+#endif
+    run_test(spiffs_differential_stress);
+    delay(500);
+#if SPIFFS_CIRCULAR_QUEUE_IDLE_GC
+    run_test(spiffs_maintain_idle_gc);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+    run_test(spiffs_space_headroom);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+    run_test(spiffs_wait_producer_consumer);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+    run_test(spiffs_watermark_callbacks);
+    delay(500);
+#endif
+    run_test(spiffs_enqueuev_fragments);
+    delay(500);
+    run_test(spiffs_enqueue_with_writer);
+    delay(500);
+    run_test(spiffs_consume_zero_copy);
+    delay(500);
+    run_test(spiffs_dequeue_frame_mtu);
+    delay(500);
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    run_test(spiffs_block_format);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+    run_test(spiffs_fd_pool_many_queues);
+    delay(500);
+    run_test(spiffs_fd_pool_repointed_queue);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+    run_test(spiffs_multi_queues_shared_area);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+    run_test(spiffs_prio_levels_order);
+    delay(500);
+#endif
 
     printf("\n\n");
     test_type = TEST_TYPE_FIXED_ELEM_SIZE;
@@ -745,6 +2442,90 @@ void loop() {
     delay(500);
     run_test(spiffs_is_empty_fixed);
     delay(500);
+#if SPIFFS_CIRCULAR_QUEUE_THREAD_SAFE
+    run_test(spiffs_concurrent_producer_consumer);
+    delay(500);
+    run_test(spiffs_concurrent_persist_reinit);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_RAM_FRONTEND
+    run_test(spiffs_frontend_enqueue_buffered);
+    delay(500);
+    run_test(spiffs_frontend_flush);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_ISR_STAGING
+    run_test(spiffs_staging_enqueue_from_isr);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_ASYNC
+    run_test(spiffs_async_enqueue_dequeue);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_CURSORS
+    run_test(spiffs_cursors_dequeue_for);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_RECOVERY_SCAN
+    run_test(spiffs_recovery_scan);
+    delay(500);
+    run_test(spiffs_recovery_scan_timing);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_DEFERRED_PERSIST
+    run_test(spiffs_deferred_persist_sync_all);
+    delay(500);
+    run_test(spiffs_durability_levels);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_FAULT_INJECTION
+    run_test(spiffs_power_cut_sweep);
+    delay(500);
+#endif
+    run_test(spiffs_differential_stress);
+    delay(500);
+#if SPIFFS_CIRCULAR_QUEUE_IDLE_GC
+    run_test(spiffs_maintain_idle_gc);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_SPACE_MANAGER
+    run_test(spiffs_space_headroom);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WAIT
+    run_test(spiffs_wait_producer_consumer);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_WATERMARKS
+    run_test(spiffs_watermark_callbacks);
+    delay(500);
+#endif
+    run_test(spiffs_enqueuev_fragments);
+    delay(500);
+    run_test(spiffs_enqueue_with_writer);
+    delay(500);
+    run_test(spiffs_consume_zero_copy);
+    delay(500);
+    run_test(spiffs_dequeue_frame_mtu);
+    delay(500);
+#if SPIFFS_CIRCULAR_QUEUE_BLOCKS
+    run_test(spiffs_block_format);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_FD_POOL_SIZE
+    run_test(spiffs_fd_pool_many_queues);
+    delay(500);
+    run_test(spiffs_fd_pool_repointed_queue);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_MULTI
+    run_test(spiffs_multi_queues_shared_area);
+    delay(500);
+#endif
+#if SPIFFS_CIRCULAR_QUEUE_PRIO
+    run_test(spiffs_prio_levels_order);
+    delay(500);
+#endif
 
     printf("\n\n");
     printf("\n\n");